@@ -0,0 +1,109 @@
+#include "bench.h"
+
+// Accept rate benchmark. Hammers the server with connect/close from several
+// threads, and counts how many connections the server manages to accept with
+// a single acceptor versus one SO_REUSEPORT acceptor per io thread
+
+namespace
+{
+	enum class AcceptMsgTypes : uint32_t
+	{
+		Nothing,
+	};
+
+	class AcceptServer : public net::server_interface<AcceptMsgTypes>
+	{
+	public:
+		AcceptServer(uint16_t nPort, size_t nIOThreads, size_t nAcceptors)
+			: net::server_interface<AcceptMsgTypes>(nPort, nIOThreads, nAcceptors)
+		{}
+
+		std::atomic<size_t> nAccepted = 0;
+
+	protected:
+		// Count the client and turn it straight away, we're only timing the accepts
+		virtual bool OnClientConnect(std::shared_ptr<net::connection<AcceptMsgTypes>> client)
+		{
+			nAccepted++;
+			return false;
+		}
+	};
+
+	// Connects over and over until told to stop
+	void ConnectStorm(uint16_t nPort, std::atomic<bool>& bRunning)
+	{
+		asio::io_context context;
+		asio::ip::tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), nPort);
+
+		while (bRunning)
+		{
+			asio::ip::tcp::socket socket(context);
+			asio::error_code ec;
+			socket.connect(endpoint, ec);
+			if (!ec)
+			{
+				// Reset rather than close, so thousands of TIME_WAIT sockets don't
+				// run us out of ephemeral ports
+				socket.set_option(asio::socket_base::linger(true, 0), ec);
+			}
+			socket.close(ec);
+		}
+	}
+
+	double MeasureAcceptRate(uint16_t nPort, size_t nIOThreads, size_t nAcceptors, size_t nClientThreads, size_t nSeconds)
+	{
+		AcceptServer server(nPort, nIOThreads, nAcceptors);
+		server.Start();
+
+		std::atomic<bool> bRunning = true;
+		std::vector<std::thread> vClients;
+		for (size_t i = 0; i < nClientThreads; i++)
+		{
+			vClients.emplace_back(ConnectStorm, nPort, std::ref(bRunning));
+		}
+
+		// Let the storm get going before counting
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		size_t nStart = server.nAccepted;
+		auto tStart = bench::clock::now();
+
+		std::this_thread::sleep_for(std::chrono::seconds(nSeconds));
+
+		double dRate = double(server.nAccepted - nStart) / bench::SecondsSince(tStart);
+
+		bRunning = false;
+		for (auto& t : vClients)
+		{
+			t.join();
+		}
+		server.Stop();
+		return dRate;
+	}
+}
+
+int bench::RunAcceptBench(int argc, char** argv)
+{
+	size_t nSeconds = Arg(argc, argv, 1, 3);
+	size_t nClientThreads = Arg(argc, argv, 2, 8);
+	// At least two, or the reuseport run would be the single acceptor run over again
+	size_t nIOThreads = Arg(argc, argv, 3, std::max(2u, std::thread::hardware_concurrency() / 2));
+
+	// Single acceptor, then one acceptor per io thread
+	for (size_t nAcceptors : { size_t(1), nIOThreads })
+	{
+		double dRate = 0.0;
+		{
+			quiet_log quiet;
+			dRate = MeasureAcceptRate(60100, nIOThreads, nAcceptors, nClientThreads, nSeconds);
+		}
+
+		result("accept")
+			.add("mode", nAcceptors > 1 ? "reuseport" : "single")
+			.add("acceptors", double(nAcceptors))
+			.add("io_threads", double(nIOThreads))
+			.add("client_threads", double(nClientThreads))
+			.add("accepts_per_sec", dRate)
+			.print();
+	}
+	return 0;
+}
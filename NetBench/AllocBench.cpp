@@ -0,0 +1,186 @@
+#include "bench.h"
+
+// Allocation benchmark. Pushes messages through the same steps a message takes
+// inside the framework: built up a field at a time, copied into a queue, popped
+// out and thrown away. Compares a plain std::vector body with the pooled
+// message_body, counting trips to the heap per message. Then does the same for
+// real, sending messages over loopback to a server that bounces them back, so
+// everything between Send() and Incoming() is counted too
+
+namespace
+{
+	enum class AllocMsgTypes : uint32_t
+	{
+		Echo,
+	};
+
+	class EchoServer : public net::server_interface<AllocMsgTypes>
+	{
+	public:
+		EchoServer(uint16_t nPort)
+			: net::server_interface<AllocMsgTypes>(nPort)
+		{}
+
+		// Wake Update() up so a thread waiting in it can notice it should stop
+		void Wake()
+		{
+			m_qMessagesIn.push_back({});
+		}
+
+	protected:
+		virtual bool OnClientConnect(std::shared_ptr<net::connection<AllocMsgTypes>> client)
+		{
+			return true;
+		}
+
+		virtual void OnMessage(std::shared_ptr<net::connection<AllocMsgTypes>> client, net::message<AllocMsgTypes>& msg)
+		{
+			if (client)
+			{
+				client->Send(std::move(msg));
+			}
+		}
+	};
+
+	// One message's life. Mirrors what message<T>::operator << and the queues do
+	template<typename Body>
+	void MessageLifetime(net::tsqueue<Body>& queue, size_t nFields)
+	{
+		Body body;
+		for (size_t i = 0; i < nFields; i++)
+		{
+			uint64_t nField = i;
+			size_t nEnd = body.size();
+			body.resize(nEnd + sizeof(uint64_t));
+			std::memcpy(body.data() + nEnd, &nField, sizeof(uint64_t));
+		}
+
+		queue.push_back(body);
+		Body received = queue.pop_front();
+	}
+
+	template<typename Body>
+	void MeasureBody(const char* sBody, size_t nMessages, size_t nFields)
+	{
+		net::tsqueue<Body> queue;
+
+		// Warm up, so the pool (and the queue) have settled
+		for (size_t i = 0; i < 1000; i++)
+		{
+			MessageLifetime(queue, nFields);
+		}
+
+		size_t nStartAllocations = bench::HeapAllocations();
+		auto tStart = bench::clock::now();
+
+		for (size_t i = 0; i < nMessages; i++)
+		{
+			MessageLifetime(queue, nFields);
+		}
+
+		double dSeconds = bench::SecondsSince(tStart);
+		size_t nAllocations = bench::HeapAllocations() - nStartAllocations;
+
+		bench::result("alloc")
+			.add("body", sBody)
+			.add("body_bytes", double(nFields * sizeof(uint64_t)))
+			.add("messages", double(nMessages))
+			.add("heap_allocs_per_msg", double(nAllocations) / double(nMessages))
+			.add("ns_per_msg", dSeconds * 1e9 / double(nMessages))
+			.print();
+	}
+
+	// One message sent to the echo server and received back
+	void EchoMessage(net::client_interface<AllocMsgTypes>& client, size_t nFields)
+	{
+		net::message<AllocMsgTypes> msg;
+		msg.header.id = AllocMsgTypes::Echo;
+		for (size_t i = 0; i < nFields; i++)
+		{
+			msg << uint64_t(i);
+		}
+		client.Send(std::move(msg));
+
+		client.Incoming().wait();
+		client.Incoming().pop_front();
+	}
+
+	void MeasureWire(uint16_t nPort, size_t nMessages, size_t nFields)
+	{
+		// Round trips are a lot slower than the rest, so do fewer of them
+		size_t nRoundTrips = std::max<size_t>(nMessages / 20, 1);
+		size_t nAllocations = 0;
+		double dSeconds = 0.0;
+		{
+			bench::quiet_log quiet;
+
+			EchoServer server(nPort);
+			server.Start();
+
+			std::atomic<bool> bRunning = true;
+			std::thread thrUpdate([&]() { while (bRunning) server.Update(-1, true); });
+
+			net::client_interface<AllocMsgTypes> client;
+			client.Connect("127.0.0.1", nPort);
+
+			// Warm up, which also waits out the handshake
+			for (size_t i = 0; i < 1000; i++)
+			{
+				EchoMessage(client, nFields);
+			}
+
+			size_t nStartAllocations = bench::HeapAllocations();
+			auto tStart = bench::clock::now();
+
+			for (size_t i = 0; i < nRoundTrips; i++)
+			{
+				EchoMessage(client, nFields);
+			}
+
+			dSeconds = bench::SecondsSince(tStart);
+			nAllocations = bench::HeapAllocations() - nStartAllocations;
+
+			client.Disconnect();
+			bRunning = false;
+			server.Wake();
+			thrUpdate.join();
+			server.Stop();
+		}
+
+		// Each round trip sends and receives two messages, one each way
+		double dMessages = double(nRoundTrips * 2);
+		bench::result("alloc")
+			.add("body", "wire")
+			.add("body_bytes", double(nFields * sizeof(uint64_t)))
+			.add("messages", dMessages)
+			.add("heap_allocs_per_msg", double(nAllocations) / dMessages)
+			.add("ns_per_msg", dSeconds * 1e9 / dMessages)
+			.print();
+	}
+}
+
+int bench::RunAllocBench(int argc, char** argv)
+{
+	size_t nMessages = Arg(argc, argv, 1, 1000000);
+
+	// From a couple of fields up to a few KB
+	for (size_t nFields : { 2, 16, 128, 512 })
+	{
+		MeasureBody<std::vector<uint8_t>>("vector", nMessages, nFields);
+		MeasureBody<net::message_body>("pooled", nMessages, nFields);
+	}
+
+	uint16_t nPort = 60140;
+	for (size_t nFields : { 2, 16, 128, 512 })
+	{
+		MeasureWire(nPort++, nMessages, nFields);
+	}
+
+	net::buffer_pool::stats stats = net::buffer_pool::Get().GetStats();
+	result("alloc_pool")
+		.add("heap_allocations", double(stats.nHeapAllocations))
+		.add("oversize_allocations", double(stats.nOversizeAllocations))
+		.add("heap_frees", double(stats.nHeapFrees))
+		.print();
+	return 0;
+}
@@ -0,0 +1,157 @@
+#include "bench.h"
+
+// Broadcast benchmark. The server sends the same message to every client with
+// MessageAllClients(), for a growing number of clients, and times how long until
+// every client has all of them. Reports the cost of a broadcast, and of each copy
+// delivered, so the per client part of the cost stands out
+
+namespace
+{
+	enum class FanoutMsgTypes : uint32_t
+	{
+		Broadcast,
+	};
+
+	class FanoutServer : public net::server_interface<FanoutMsgTypes>
+	{
+	public:
+		FanoutServer(uint16_t nPort)
+			: net::server_interface<FanoutMsgTypes>(nPort)
+		{}
+
+		size_t GetClientCount()
+		{
+			return GetClients()->size();
+		}
+
+	protected:
+		virtual bool OnClientConnect(std::shared_ptr<net::connection<FanoutMsgTypes>> client)
+		{
+			return true;
+		}
+	};
+
+	// Counts what arrives, on the io thread
+	class CountingClient : public net::client_interface<FanoutMsgTypes>
+	{
+	public:
+		CountingClient(asio::io_context& context)
+			: net::client_interface<FanoutMsgTypes>(context)
+		{
+			SetDispatchMode(net::dispatch_mode::inline_io);
+		}
+
+		std::atomic<size_t> nReceived = 0;
+
+	protected:
+		virtual void OnMessage(net::message<FanoutMsgTypes>& msg)
+		{
+			nReceived.fetch_add(1, std::memory_order_relaxed);
+		}
+	};
+
+	void MeasureFanout(uint16_t nPort, size_t nClients, size_t nBroadcasts, size_t nPayload)
+	{
+		double dSendSeconds = 0.0;
+		double dDeliverSeconds = 0.0;
+		size_t nDelivered = 0;
+		size_t nAllocations = 0;
+		{
+			bench::quiet_log quiet;
+
+			FanoutServer server(nPort);
+
+			// The broadcasting thread waits for slow clients rather than losing them
+			net::queue_limits limits;
+			limits.policy = net::backpressure_policy::block;
+			server.SetQueueLimits(limits);
+			server.Start();
+
+			// The clients share a few io threads, rather than having one each
+			size_t nThreads = std::min<size_t>(nClients, 4);
+			net::io_pool clientPool(nThreads);
+			std::vector<std::unique_ptr<CountingClient>> vClients;
+			for (size_t i = 0; i < nClients; i++)
+			{
+				vClients.push_back(std::make_unique<CountingClient>(clientPool.GetNextContext()));
+				vClients.back()->Connect("127.0.0.1", nPort);
+			}
+			clientPool.Start();
+
+			// Wait for everybody to be through the handshake
+			auto tWait = bench::clock::now();
+			while (server.GetClientCount() < nClients && bench::SecondsSince(tWait) < 10.0)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+			net::message<FanoutMsgTypes> msg;
+			msg.header.id = FanoutMsgTypes::Broadcast;
+			msg.body.resize(nPayload);
+			msg.header.size = uint32_t(nPayload);
+
+			size_t nStartAllocations = bench::HeapAllocations();
+			auto tStart = bench::clock::now();
+
+			for (size_t i = 0; i < nBroadcasts; i++)
+			{
+				server.MessageAllClients(msg);
+			}
+			dSendSeconds = bench::SecondsSince(tStart);
+			nAllocations = bench::HeapAllocations() - nStartAllocations;
+
+			// Then wait for it all to arrive, or give up
+			size_t nExpected = nClients * nBroadcasts;
+			while (bench::SecondsSince(tStart) < 30.0)
+			{
+				nDelivered = 0;
+				for (auto& client : vClients)
+				{
+					nDelivered += client->nReceived;
+				}
+				if (nDelivered >= nExpected)
+				{
+					break;
+				}
+				std::this_thread::yield();
+			}
+			dDeliverSeconds = bench::SecondsSince(tStart);
+
+			// The clients run on the pool's threads, so they can only be disconnected
+			// from here once it has stopped
+			clientPool.Stop();
+			for (auto& client : vClients)
+			{
+				client->Disconnect();
+			}
+			server.Stop();
+		}
+
+		bench::result("fanout")
+			.add("clients", double(nClients))
+			.add("broadcasts", double(nBroadcasts))
+			.add("payload_bytes", double(nPayload))
+			.add("delivered", double(nDelivered))
+			.add("broadcasts_per_sec", double(nBroadcasts) / dDeliverSeconds)
+			.add("deliveries_per_sec", double(nDelivered) / dDeliverSeconds)
+			.add("send_ns_per_broadcast", dSendSeconds * 1e9 / double(nBroadcasts))
+			.add("send_ns_per_client", dSendSeconds * 1e9 / double(nBroadcasts * nClients))
+			.add("heap_allocs_per_broadcast", double(nAllocations) / double(nBroadcasts))
+			.print();
+	}
+}
+
+int bench::RunFanoutBench(int argc, char** argv)
+{
+	size_t nBroadcasts = Arg(argc, argv, 1, 20000);
+	size_t nMaxClients = Arg(argc, argv, 2, 64);
+	size_t nPayload = Arg(argc, argv, 3, 64);
+
+	uint16_t nPort = 60130;
+	for (size_t nClients = 1; nClients <= nMaxClients; nClients *= 4)
+	{
+		MeasureFanout(nPort++, nClients, nBroadcasts, nPayload);
+	}
+	return 0;
+}
@@ -0,0 +1,95 @@
+#include "bench.h"
+#include <new>
+#include <cstdlib>
+
+// Usage: NetBench [--json] <benchmark> [arguments...]
+// Run with no arguments to list the benchmarks. --json prints each result as a
+// JSON object on a line of its own, for comparing runs with a script
+
+// Count every trip to the heap, so benchmarks can report allocations per message
+static std::atomic<size_t> nHeapAllocations = 0;
+
+void* operator new(size_t nBytes)
+{
+	nHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(nBytes ? nBytes : 1))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	std::free(p);
+}
+
+size_t bench::HeapAllocations()
+{
+	return nHeapAllocations.load(std::memory_order_relaxed);
+}
+
+// Everything that goes over loopback, for keeping an eye on the framework run
+// over run. accept and queue are left out, they're about more specialized changes
+static int RunSuite(int argc, char** argv)
+{
+	char* vNoArgs[] = { argv[0], nullptr };
+	int nResult = 0;
+	nResult |= bench::RunThroughputBench(1, vNoArgs);
+	nResult |= bench::RunPingPongBench(1, vNoArgs);
+	nResult |= bench::RunFanoutBench(1, vNoArgs);
+	nResult |= bench::RunAllocBench(1, vNoArgs);
+	return nResult;
+}
+
+struct benchmark
+{
+	const char* sName;
+	const char* sUsage;
+	int (*pfnRun)(int argc, char** argv);
+};
+
+static const benchmark vBenchmarks[] =
+{
+	{ "accept", "accept [seconds] [client threads] [io threads]", bench::RunAcceptBench },
+	{ "queue", "queue [messages per producer] [max producers]", bench::RunQueueBench },
+	{ "alloc", "alloc [messages]", bench::RunAllocBench },
+	{ "pingpong", "pingpong [round trips]", bench::RunPingPongBench },
+	{ "throughput", "throughput [seconds per size] [clients]", bench::RunThroughputBench },
+	{ "fanout", "fanout [broadcasts] [max clients] [payload bytes]", bench::RunFanoutBench },
+	{ "suite", "suite (the loopback benchmarks, with their defaults)", RunSuite },
+};
+
+int main(int argc, char** argv)
+{
+	if (argc > 1 && std::string(argv[1]) == "--json")
+	{
+		bench::bJsonOutput = true;
+		argc--;
+		argv++;
+	}
+
+	if (argc > 1)
+	{
+		for (const auto& b : vBenchmarks)
+		{
+			if (std::string(argv[1]) == b.sName)
+			{
+				// Hand over the arguments that follow the benchmark's name
+				return b.pfnRun(argc - 1, argv + 1);
+			}
+		}
+	}
+
+	std::printf("Usage: NetBench [--json] <benchmark> [arguments...]\n");
+	for (const auto& b : vBenchmarks)
+	{
+		std::printf("  %s\n", b.sUsage);
+	}
+	return 1;
+}
@@ -0,0 +1,177 @@
+#include "bench.h"
+#include <future>
+
+// Round trip latency benchmark. One client sends a ping, waits for the server to
+// bounce it back, and sends the next. Run with both ends queued, where messages
+// go through the inbound queue to an Update() thread, and with both ends inline,
+// where they are handled on the io thread that read them
+
+namespace
+{
+	enum class PingMsgTypes : uint32_t
+	{
+		Ping,
+	};
+
+	class PingServer : public net::server_interface<PingMsgTypes>
+	{
+	public:
+		PingServer(uint16_t nPort, net::dispatch_mode nMode)
+			: net::server_interface<PingMsgTypes>(nPort)
+		{
+			SetDispatchMode(nMode);
+		}
+
+		// Wake Update() up so a thread waiting in it can notice it should stop
+		void Wake()
+		{
+			m_qMessagesIn.push_back({});
+		}
+
+	protected:
+		virtual bool OnClientConnect(std::shared_ptr<net::connection<PingMsgTypes>> client)
+		{
+			return true;
+		}
+
+		virtual void OnMessage(std::shared_ptr<net::connection<PingMsgTypes>> client, net::message<PingMsgTypes>& msg)
+		{
+			if (client)
+			{
+				client->Send(std::move(msg));
+			}
+		}
+	};
+
+	class PingClient : public net::client_interface<PingMsgTypes>
+	{
+	public:
+		// Inline mode only. Keeps the pings going from the io thread, and lets the
+		// caller know once nRoundTrips have come back
+		std::future<void> Run(size_t nRoundTrips)
+		{
+			m_vSamples.clear();
+			m_vSamples.reserve(nRoundTrips);
+			m_nRoundTrips = nRoundTrips;
+			m_promiseDone = std::promise<void>();
+			SendPing();
+			return m_promiseDone.get_future();
+		}
+
+		void SendPing()
+		{
+			net::message<PingMsgTypes> msg;
+			msg.header.id = PingMsgTypes::Ping;
+			msg << uint64_t(0);
+			m_tSent = bench::clock::now();
+			Send(std::move(msg));
+		}
+
+		// Round trip times in microseconds
+		std::vector<double> m_vSamples;
+		bench::clock::time_point m_tSent;
+
+	protected:
+		virtual void OnMessage(net::message<PingMsgTypes>& msg)
+		{
+			m_vSamples.push_back(std::chrono::duration<double, std::micro>(bench::clock::now() - m_tSent).count());
+			if (m_vSamples.size() < m_nRoundTrips)
+			{
+				SendPing();
+			}
+			else
+			{
+				m_promiseDone.set_value();
+			}
+		}
+
+	private:
+		size_t m_nRoundTrips = 0;
+		std::promise<void> m_promiseDone;
+	};
+
+	// Round trips driven from this thread, through the client's incoming queue
+	std::vector<double> QueuedRoundTrips(PingClient& client, size_t nRoundTrips)
+	{
+		client.m_vSamples.clear();
+		client.m_vSamples.reserve(nRoundTrips);
+		for (size_t i = 0; i < nRoundTrips; i++)
+		{
+			client.SendPing();
+			client.Incoming().wait();
+			client.Incoming().pop_front();
+			client.m_vSamples.push_back(std::chrono::duration<double, std::micro>(bench::clock::now() - client.m_tSent).count());
+		}
+		return client.m_vSamples;
+	}
+
+	std::vector<double> InlineRoundTrips(PingClient& client, size_t nRoundTrips)
+	{
+		client.Run(nRoundTrips).wait();
+		return client.m_vSamples;
+	}
+
+	void MeasureRoundTrips(const char* sMode, net::dispatch_mode nMode, uint16_t nPort, size_t nRoundTrips)
+	{
+		std::vector<double> vSamples;
+		{
+			bench::quiet_log quiet;
+
+			PingServer server(nPort, nMode);
+			server.Start();
+
+			// Queued servers need somebody calling Update()
+			std::atomic<bool> bRunning = true;
+			std::thread thrUpdate;
+			if (nMode == net::dispatch_mode::queued)
+			{
+				thrUpdate = std::thread([&]() { while (bRunning) server.Update(-1, true); });
+			}
+
+			PingClient client;
+			client.SetDispatchMode(nMode);
+			client.Connect("127.0.0.1", nPort);
+
+			auto fnRoundTrips = nMode == net::dispatch_mode::queued ? QueuedRoundTrips : InlineRoundTrips;
+
+			// Warm up, which also waits out the handshake
+			fnRoundTrips(client, 1000);
+			vSamples = fnRoundTrips(client, nRoundTrips);
+
+			client.Disconnect();
+			bRunning = false;
+			if (thrUpdate.joinable())
+			{
+				server.Wake();
+				thrUpdate.join();
+			}
+			server.Stop();
+		}
+
+		std::sort(vSamples.begin(), vSamples.end());
+		double dTotal = 0;
+		for (double d : vSamples)
+		{
+			dTotal += d;
+		}
+
+		bench::result("pingpong")
+			.add("mode", sMode)
+			.add("round_trips", double(vSamples.size()))
+			.add("mean_us", dTotal / double(vSamples.size()))
+			.add("p50_us", bench::Percentile(vSamples, 0.50))
+			.add("p99_us", bench::Percentile(vSamples, 0.99))
+			.add("p999_us", bench::Percentile(vSamples, 0.999))
+			.add("max_us", vSamples.back())
+			.print();
+	}
+}
+
+int bench::RunPingPongBench(int argc, char** argv)
+{
+	size_t nRoundTrips = Arg(argc, argv, 1, 20000);
+
+	MeasureRoundTrips("queued", net::dispatch_mode::queued, 60110, nRoundTrips);
+	MeasureRoundTrips("inline", net::dispatch_mode::inline_io, 60111, nRoundTrips);
+	return 0;
+}
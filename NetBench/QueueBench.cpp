@@ -0,0 +1,90 @@
+#include "bench.h"
+
+// Inbound queue contention benchmark. Several producer threads stand in for io
+// threads pushing owned_messages, while one consumer drains them the way
+// server_interface::Update() does. Compares the locking tsqueue against the
+// lock free mpscqueue
+
+namespace
+{
+	enum class QueueMsgTypes : uint32_t
+	{
+		Payload,
+	};
+
+	using queued_message = net::owned_message<QueueMsgTypes>;
+
+	template<typename Queue>
+	double MeasureQueue(size_t nProducers, size_t nMessagesEach)
+	{
+		Queue queue;
+
+		// Typical small message, the copy of which is part of the cost of a push
+		queued_message item;
+		item.msg.header.id = QueueMsgTypes::Payload;
+		item.msg << uint64_t(0) << uint64_t(0);
+
+		std::atomic<bool> bGo = false;
+		std::vector<std::thread> vProducers;
+		for (size_t i = 0; i < nProducers; i++)
+		{
+			vProducers.emplace_back(
+				[&]()
+				{
+					while (!bGo)
+					{
+						std::this_thread::yield();
+					}
+
+					for (size_t n = 0; n < nMessagesEach; n++)
+					{
+						queue.push_back(item);
+					}
+				});
+		}
+
+		auto tStart = bench::clock::now();
+		bGo = true;
+
+		// Consume the way a polling Update() does
+		size_t nTotal = nProducers * nMessagesEach;
+		size_t nReceived = 0;
+		while (nReceived < nTotal)
+		{
+			while (!queue.empty())
+			{
+				auto msg = queue.pop_front();
+				nReceived++;
+			}
+			std::this_thread::yield();
+		}
+
+		double dSeconds = bench::SecondsSince(tStart);
+		for (auto& t : vProducers)
+		{
+			t.join();
+		}
+		return double(nTotal) / dSeconds;
+	}
+}
+
+int bench::RunQueueBench(int argc, char** argv)
+{
+	size_t nMessagesEach = Arg(argc, argv, 1, 500000);
+	size_t nMaxProducers = Arg(argc, argv, 2, std::max(2u, std::thread::hardware_concurrency()));
+
+	for (size_t nProducers = 1; nProducers <= nMaxProducers; nProducers *= 2)
+	{
+		double dLocking = MeasureQueue<net::tsqueue<queued_message>>(nProducers, nMessagesEach);
+		double dLockFree = MeasureQueue<net::mpscqueue<queued_message>>(nProducers, nMessagesEach);
+
+		result("queue")
+			.add("producers", double(nProducers))
+			.add("messages", double(nProducers * nMessagesEach))
+			.add("tsqueue_per_sec", dLocking)
+			.add("mpscqueue_per_sec", dLockFree)
+			.add("speedup", dLockFree / dLocking)
+			.print();
+	}
+	return 0;
+}
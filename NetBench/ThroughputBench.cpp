@@ -0,0 +1,145 @@
+#include "bench.h"
+
+// Throughput benchmark. Several clients send to the server over loopback as fast
+// as the framework lets them, one payload size at a time, and the server counts
+// what arrives. Reports messages/s, MB/s of payload, and trips to the heap per
+// message (both ends, as they share the process)
+
+namespace
+{
+	enum class ThroughputMsgTypes : uint32_t
+	{
+		Payload,
+	};
+
+	class CountingServer : public net::server_interface<ThroughputMsgTypes>
+	{
+	public:
+		CountingServer(uint16_t nPort)
+			: net::server_interface<ThroughputMsgTypes>(nPort)
+		{}
+
+		// Wake Update() up so a thread waiting in it can notice it should stop
+		void Wake()
+		{
+			m_qMessagesIn.push_back({});
+		}
+
+		std::atomic<size_t> nMessages = 0;
+		std::atomic<size_t> nBytes = 0;
+
+	protected:
+		virtual bool OnClientConnect(std::shared_ptr<net::connection<ThroughputMsgTypes>> client)
+		{
+			return true;
+		}
+
+		virtual void OnMessage(std::shared_ptr<net::connection<ThroughputMsgTypes>> client, net::message<ThroughputMsgTypes>& msg)
+		{
+			if (client)
+			{
+				nMessages.fetch_add(1, std::memory_order_relaxed);
+				nBytes.fetch_add(msg.body.size(), std::memory_order_relaxed);
+			}
+		}
+	};
+
+	void MeasureThroughput(uint16_t nPort, size_t nPayload, size_t nClients, size_t nSeconds)
+	{
+		size_t nMessages = 0;
+		size_t nBytes = 0;
+		size_t nAllocations = 0;
+		double dSeconds = 0.0;
+		{
+			bench::quiet_log quiet;
+
+			CountingServer server(nPort);
+			server.Start();
+
+			std::atomic<bool> bRunning = true;
+			std::thread thrUpdate([&]() { while (bRunning) server.Update(-1, true); });
+
+			// Senders wait for the queue to drain rather than outrun the socket
+			net::queue_limits limits;
+			limits.nHighWaterBytes = 4 * 1024 * 1024;
+			limits.nLowWaterBytes = 2 * 1024 * 1024;
+			limits.policy = net::backpressure_policy::block;
+
+			std::vector<std::unique_ptr<net::client_interface<ThroughputMsgTypes>>> vClients;
+			for (size_t i = 0; i < nClients; i++)
+			{
+				vClients.push_back(std::make_unique<net::client_interface<ThroughputMsgTypes>>());
+				vClients.back()->SetQueueLimits(limits);
+				vClients.back()->Connect("127.0.0.1", nPort);
+			}
+
+			// Each client gets a thread sending copies of the same message
+			std::vector<std::thread> vSenders;
+			for (auto& client : vClients)
+			{
+				vSenders.emplace_back([&bRunning, &client, nPayload]()
+					{
+						net::message<ThroughputMsgTypes> msg;
+						msg.header.id = ThroughputMsgTypes::Payload;
+						msg.body.resize(nPayload);
+						msg.header.size = uint32_t(nPayload);
+
+						while (bRunning)
+						{
+							client->Send(msg);
+						}
+					});
+			}
+
+			// Let the handshakes finish and the queues fill before counting
+			std::this_thread::sleep_for(std::chrono::milliseconds(300));
+			size_t nStartMessages = server.nMessages;
+			size_t nStartBytes = server.nBytes;
+			size_t nStartAllocations = bench::HeapAllocations();
+			auto tStart = bench::clock::now();
+
+			std::this_thread::sleep_for(std::chrono::seconds(nSeconds));
+
+			nMessages = server.nMessages - nStartMessages;
+			nBytes = server.nBytes - nStartBytes;
+			nAllocations = bench::HeapAllocations() - nStartAllocations;
+			dSeconds = bench::SecondsSince(tStart);
+
+			bRunning = false;
+			for (auto& t : vSenders)
+			{
+				t.join();
+			}
+			for (auto& client : vClients)
+			{
+				client->Disconnect();
+			}
+			server.Wake();
+			thrUpdate.join();
+			server.Stop();
+		}
+
+		bench::result("throughput")
+			.add("payload_bytes", double(nPayload))
+			.add("clients", double(nClients))
+			.add("msgs_per_sec", double(nMessages) / dSeconds)
+			.add("mb_per_sec", double(nBytes) / dSeconds / (1024.0 * 1024.0))
+			.add("heap_allocs_per_msg", nMessages ? double(nAllocations) / double(nMessages) : 0.0)
+			.print();
+	}
+}
+
+int bench::RunThroughputBench(int argc, char** argv)
+{
+	size_t nSeconds = Arg(argc, argv, 1, 2);
+	size_t nClients = Arg(argc, argv, 2, 4);
+
+	// From messages that are mostly header up to ones that take several writes
+	uint16_t nPort = 60120;
+	for (size_t nPayload : { 16, 256, 4096, 65536 })
+	{
+		// A port each, so one run's connections lingering can't get in the next's way
+		MeasureThroughput(nPort++, nPayload, nClients, nSeconds);
+	}
+	return 0;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <net.h>
+#include <cstdio>
+#include <string>
+#include <sstream>
+#include <functional>
+
+// Small helpers shared by all of the benchmarks
+namespace bench
+{
+	using clock = std::chrono::steady_clock;
+
+	// Seconds elapsed since a point in time
+	inline double SecondsSince(clock::time_point tStart)
+	{
+		return std::chrono::duration<double>(clock::now() - tStart).count();
+	}
+
+	// Print results as JSON objects, one per line, rather than key=value text.
+	// Set by NetBench's --json flag
+	inline bool bJsonOutput = false;
+
+	// One line of results: the benchmark name followed by key=value pairs, so runs
+	// can be grepped and compared easily. With bJsonOutput set the same line is a
+	// JSON object instead, {"bench":name, key:value...}, for scripts to pick up
+	class result
+	{
+	public:
+		result(const std::string& sName)
+		{
+			add("bench", sName);
+		}
+
+		result& add(const std::string& sKey, const std::string& sValue)
+		{
+			m_vFields.push_back({ sKey, sValue, true });
+			return *this;
+		}
+
+		result& add(const std::string& sKey, const char* sValue)
+		{
+			return add(sKey, std::string(sValue));
+		}
+
+		result& add(const std::string& sKey, double dValue)
+		{
+			std::ostringstream os;
+			os << dValue;
+			m_vFields.push_back({ sKey, os.str(), false });
+			return *this;
+		}
+
+		void print() const
+		{
+			std::string sLine;
+			if (bJsonOutput)
+			{
+				for (const auto& f : m_vFields)
+				{
+					sLine += sLine.empty() ? "{" : ",";
+					sLine += "\"" + f.sKey + "\":" + (f.bString ? "\"" + f.sValue + "\"" : f.sValue);
+				}
+				sLine += "}";
+			}
+			else
+			{
+				// The name goes first on its own, then everything else
+				sLine = m_vFields[0].sValue;
+				for (size_t i = 1; i < m_vFields.size(); i++)
+				{
+					sLine += " " + m_vFields[i].sKey + "=" + m_vFields[i].sValue;
+				}
+			}
+
+			std::printf("%s\n", sLine.c_str());
+			std::fflush(stdout);
+		}
+
+	private:
+		struct field
+		{
+			std::string sKey;
+			std::string sValue;
+			bool bString;
+		};
+
+		std::vector<field> m_vFields;
+	};
+
+	// Value below which dFraction of the (sorted) samples fall
+	inline double Percentile(const std::vector<double>& vSorted, double dFraction)
+	{
+		size_t nIndex = std::min(vSorted.size() - 1, size_t(dFraction * double(vSorted.size())));
+		return vSorted[nIndex];
+	}
+
+	// The framework logs every connection, which would swamp both the results and the
+	// timings. Turn its logging off for as long as this is alive
+	class quiet_log
+	{
+	public:
+		quiet_log() : m_nOld(net::logger::Get().GetLevel())
+		{
+			net::logger::Get().SetLevel(net::log_level::off);
+		}
+
+		~quiet_log()
+		{
+			net::logger::Get().SetLevel(m_nOld);
+		}
+
+	private:
+		net::log_level m_nOld;
+	};
+
+	// Read an optional numeric argument, falling back to a default
+	inline size_t Arg(int argc, char** argv, int nIndex, size_t nDefault)
+	{
+		return argc > nIndex ? size_t(std::stoull(argv[nIndex])) : nDefault;
+	}
+
+	// Number of times the global operator new has been called so far
+	size_t HeapAllocations();
+
+	// Benchmarks, one per source file. Each takes the arguments following its name
+	int RunAcceptBench(int argc, char** argv);
+	int RunQueueBench(int argc, char** argv);
+	int RunAllocBench(int argc, char** argv);
+	int RunPingPongBench(int argc, char** argv);
+	int RunThroughputBench(int argc, char** argv);
+	int RunFanoutBench(int argc, char** argv);
+}
@@ -5,4 +5,19 @@
 #include "net_client.h"
 #include "net_connection.h"
 #include "net_server.h"
-#include "net_tsqueue.h"
\ No newline at end of file
+#include "net_tsqueue.h"
+#include "net_mpscqueue.h"
+#include "net_iopool.h"
+#include "net_pool.h"
+#include "net_serializer.h"
+#include "net_view.h"
+#include "net_router.h"
+#include "net_registry.h"
+#include "net_timerwheel.h"
+#include "net_metrics.h"
+#include "net_log.h"
+
+// Stage tracing is left out completely unless asked for
+#ifdef NET_TRACE_STAGES
+#include "net_trace.h"
+#endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "net_tsqueue.h"
 #include "net_message.h"
 #include "net_connection.h"
+#include "net_log.h"
 
 namespace net
 {
@@ -13,7 +14,17 @@ namespace net
 	{
 	public:
 
+		// The client runs its own context, on a thread of its own
 		client_interface()
+			: m_pOwnContext(std::make_unique<asio::io_context>()), m_context(*m_pOwnContext)
+		{
+		}
+
+		// The client runs on a context somebody else owns and runs, so any number of
+		// clients can share a thread. Disconnect (or destroy) the client from that
+		// thread, or once the context has stopped
+		client_interface(asio::io_context& context)
+			: m_context(context)
 		{
 		}
 
@@ -34,20 +45,32 @@ namespace net
 				asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
 
 				// Create connection
-				m_connection = std::make_unique<connection<T>>(
+				m_connection = std::make_shared<connection<T>>(
 					connection<T>::owner::client,
 					m_context, asio::ip::tcp::socket(m_context),
 					m_qMessagesIn);
+				m_connection->SetHeaderFilter(m_pfnHeaderFilter);
+				m_connection->SetQueueLimits(m_queueLimits);
+				m_connection->SetTimeouts(m_timeouts);
+				m_connection->SetMetrics(&m_metrics);
+				m_connection->SetMessageHandler(
+					[this](std::shared_ptr<connection<T>>, message<T>& msg)
+					{
+						Deliver(msg);
+					});
 
 				// Tell the connection object to connect to server
 				m_connection->ConnectToServer(endpoints);
 
-				// Start context thread
-				thrContext = std::thread([this]() { m_context.run();  });
+				// Start context thread, unless somebody else is running it
+				if (m_pOwnContext)
+				{
+					thrContext = std::thread([this]() { m_context.run();  });
+				}
 			}
 			catch (std::exception& e)
 			{
-				std::cerr << "Client Exception: " << e.what() << "\n";
+				NET_LOG_ERROR("Client Exception: ", e.what());
 				return false;
 			}
 			return true;
@@ -63,16 +86,34 @@ namespace net
 				m_connection->Disconnect();
 			}
 
-			// Either way, done with the asio context
-			m_context.stop();
+			// Either way, done with the asio context, if it is ours
+			if (m_pOwnContext)
+			{
+				m_context.stop();
+			}
 			// And it's thread
 			if (thrContext.joinable())
 			{
 				thrContext.join();
 			}
 
-			// destroy the connection object
-			m_connection.release();
+			// No replies are coming now
+			while (!m_mapPendingRequests.empty())
+			{
+				CompleteRequest(m_mapPendingRequests.begin()->first, std::nullopt);
+			}
+
+#ifdef ASIO_HAS_CO_AWAIT
+			// Nothing more is coming, so wake anybody waiting for a message
+			for (receiver* pReceiver : m_qReceivers)
+			{
+				pReceiver->timer.cancel();
+			}
+			m_qReceivers.clear();
+#endif
+
+			// Let go of the connection object. It goes once the last of its work is done
+			m_connection.reset();
 		}
 
 		// Check is client is actually connected to a server
@@ -90,32 +131,367 @@ namespace net
 
 	public:
 		// Send message to server
-		void Send(const message<T>& msg)
+		send_status Send(const message<T>& msg)
+		{
+			if (IsConnected())
+			{
+				return m_connection->Send(msg);
+			}
+			return send_status::disconnected;
+		}
+
+		// Send message to server, moving it rather than copying it
+		send_status Send(message<T>&& msg)
+		{
+			if (IsConnected())
+			{
+				return m_connection->Send(std::move(msg));
+			}
+			return send_status::disconnected;
+		}
+
+		// Send a message that replaces any message with the same key that is still
+		// waiting to be written (see connection::SendConflated())
+		send_status SendConflated(message<T> msg, uint64_t nKey)
 		{
 			if (IsConnected())
 			{
-				m_connection->Send(msg);
+				return m_connection->SendConflated(std::move(msg), nKey);
 			}
+			return send_status::disconnected;
+		}
+
+		// Limits on the outgoing queue, and what happens when it is full (see
+		// queue_limits). Must be set before connecting
+		void SetQueueLimits(const queue_limits& limits)
+		{
+			m_queueLimits = limits;
+		}
+
+		// Handshake, idle and stall deadlines, and heartbeats (see connection_timeouts).
+		// Must be set before connecting
+		void SetTimeouts(const connection_timeouts<T>& timeouts)
+		{
+			m_timeouts = timeouts;
+		}
+
+		// Throw away messages from the server whose header the filter rejects. Must be
+		// set before connecting
+		void SetHeaderFilter(header_filter<T> pfnFilter)
+		{
+			m_pfnHeaderFilter = pfnFilter;
+		}
+
+		// Choose how messages from the server are picked up. Queued, the default, puts
+		// them in Incoming(). inline_io calls OnMessage() on the client's io thread as
+		// soon as each one is read, and Incoming() stays empty. Must be set before connecting
+		void SetDispatchMode(dispatch_mode nMode)
+		{
+			m_nDispatchMode = nMode;
 		}
 
-		// Retrieve queue of the messages from server
-		tsqueue<owned_message<T>>& Incoming()
+		// Retrieve queue of the messages from server. Only one thread may take from it,
+		// so a client read this way can't also use AsyncReceive(), and the other way round
+		inbound_queue<owned_message<T>>& Incoming()
 		{
+			assert(!m_bAsyncReceiving.load(std::memory_order_relaxed) && "Incoming() and AsyncReceive() can't both take messages");
+			m_bPolling.store(true, std::memory_order_relaxed);
 			return m_qMessagesIn;
 		}
 
+		// Everything counted since the client was made, over every connection it has
+		// had, and the current connection's queue
+		metrics_snapshot<T> GetMetrics()
+		{
+			metrics_snapshot<T> snapshot;
+			m_metrics.AddTo(snapshot);
+			if (m_connection)
+			{
+				snapshot.nConnections = m_connection->IsConnected() ? 1 : 0;
+				snapshot.nQueuedOutMessages = m_connection->GetQueuedMessages();
+				snapshot.nQueuedOutBytes = m_connection->GetQueuedBytes();
+				snapshot.nDropped = m_connection->GetDroppedCount();
+				snapshot.nRejected = m_connection->GetRejectedCount();
+				snapshot.nConflated = m_connection->GetConflatedCount();
+			}
+			snapshot.nQueuedInMessages = m_qMessagesIn.count();
+			return snapshot;
+		}
+
+		// The context the client's connection runs on
+		asio::io_context& GetContext()
+		{
+			return m_context;
+		}
+
+		// Send a request and have fnCallback called with the reply, matched to it by
+		// correlation ID, so any number of requests can be waiting on replies at once.
+		// If no reply comes within tTimeout (zero waits forever), or the client
+		// disconnects first, the callback gets nothing instead. The callback runs on the
+		// io thread, or from Disconnect()
+		void Request(message<T> msg, std::chrono::milliseconds tTimeout, std::function<void(std::optional<message<T>>)> fnCallback)
+		{
+			uint32_t nCorrelation = m_nNextCorrelation++;
+			if (nCorrelation == 0)
+			{
+				// Zero means no correlation, skip it when the counter wraps
+				nCorrelation = m_nNextCorrelation++;
+			}
+			msg.header.correlation = nCorrelation;
+
+			// The table of requests is only touched on the io thread
+			asio::post(m_context,
+				[this, nCorrelation, tTimeout, msg = std::move(msg), fnCallback = std::move(fnCallback)]() mutable
+				{
+					if (!IsConnected())
+					{
+						fnCallback(std::nullopt);
+						return;
+					}
+
+					pending_request& request = m_mapPendingRequests.emplace(nCorrelation,
+						pending_request{ std::move(fnCallback), asio::steady_timer(m_context) }).first->second;
+
+					if (tTimeout.count() > 0)
+					{
+						request.timer.expires_after(tTimeout);
+						request.timer.async_wait(
+							[this, nCorrelation](std::error_code ec)
+							{
+								// Cancelled means the reply arrived
+								if (!ec)
+								{
+									CompleteRequest(nCorrelation, std::nullopt);
+								}
+							});
+					}
+
+					// Nothing is coming back for a request that was never sent
+					if (m_connection->Send(std::move(msg)) != send_status::queued)
+					{
+						CompleteRequest(nCorrelation, std::nullopt);
+					}
+				});
+		}
+
+		// Send a request, the reply (or nothing, as above) arrives through the future
+		std::future<std::optional<message<T>>> Request(message<T> msg, std::chrono::milliseconds tTimeout)
+		{
+			auto pPromise = std::make_shared<std::promise<std::optional<message<T>>>>();
+			std::future<std::optional<message<T>>> future = pPromise->get_future();
+			Request(std::move(msg), tTimeout,
+				[pPromise](std::optional<message<T>> reply)
+				{
+					pPromise->set_value(std::move(reply));
+				});
+			return future;
+		}
+
+#ifdef ASIO_HAS_CO_AWAIT
+		// Coroutine versions of sending and receiving. These must be awaited from a
+		// coroutine running on the client's context, co_spawn(client.GetContext(), ...),
+		// and are meant as an alternative to polling Incoming() from another thread:
+		//
+		//	auto reply = co_await client.AsyncRequest(std::move(msg), 500ms);
+		//	if (reply) ...
+		//
+		// Many clients sharing one context (see the constructor) can each have their own
+		// coroutine, all on the one thread
+
+		// Send a message, resuming once it is in the connection's outgoing queue
+		asio::awaitable<send_status> AsyncSend(message<T> msg)
+		{
+			send_status status = Send(std::move(msg));
+			co_await asio::post(m_context, asio::use_awaitable);
+			co_return status;
+		}
+
+		// Wait for the next message from the server. Empty if it didn't arrive within
+		// tTimeout (zero waits for as long as it takes), or the client disconnected.
+		// Takes from the same queue as Incoming(), so use one or the other, never both
+		asio::awaitable<std::optional<message<T>>> AsyncReceive(std::chrono::milliseconds tTimeout = std::chrono::milliseconds(0))
+		{
+			assert(!m_bPolling.load(std::memory_order_relaxed) && "Incoming() and AsyncReceive() can't both take messages");
+			m_bAsyncReceiving.store(true, std::memory_order_relaxed);
+
+			if (!m_qMessagesIn.empty())
+			{
+				co_return m_qMessagesIn.pop_front().msg;
+			}
+
+			// Nothing yet. Sleep on a timer until Deliver() hands a message over and
+			// wakes us, or the timer runs out
+			receiver r{ asio::steady_timer(m_context) };
+			if (tTimeout.count() > 0)
+			{
+				r.timer.expires_after(tTimeout);
+			}
+			else
+			{
+				r.timer.expires_at(asio::steady_timer::time_point::max());
+			}
+
+			m_qReceivers.push_back(&r);
+			asio::error_code ec;
+			co_await r.timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+
+			m_qReceivers.erase(std::remove(m_qReceivers.begin(), m_qReceivers.end(), &r), m_qReceivers.end());
+			co_return std::move(r.msg);
+		}
+
+		// Send a request and wait for its reply, as Request(). Empty if none arrives
+		// within tTimeout
+		asio::awaitable<std::optional<message<T>>> AsyncRequest(message<T> msg, std::chrono::milliseconds tTimeout)
+		{
+			// Sleep until the request completes one way or the other
+			asio::steady_timer timerWake(m_context, asio::steady_timer::time_point::max());
+			std::optional<message<T>> reply;
+			bool bDone = false;
+
+			Request(std::move(msg), tTimeout,
+				[&](std::optional<message<T>> r)
+				{
+					reply = std::move(r);
+					bDone = true;
+					timerWake.cancel();
+				});
+
+			if (!bDone)
+			{
+				asio::error_code ec;
+				co_await timerWake.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+			}
+			co_return reply;
+		}
+#endif
+
 	protected:
+		// Called on the io thread for each message from the server, when using
+		// dispatch_mode::inline_io. Keep it short, nothing else is read while it runs
+		virtual void OnMessage(message<T>& msg)
+		{
+
+		}
+
+	private:
+		// Every message from the server comes through here, on the io thread
+		void Deliver(message<T>& msg)
+		{
+			// The reply to a request goes to whoever made it
+			if (msg.header.correlation != 0 && m_mapPendingRequests.count(msg.header.correlation))
+			{
+#ifdef NET_TRACE_STAGES
+				// The callback is the reply's handler. msg is moved into it, but its
+				// trace is plain numbers, so stays behind as it was
+				trace_scope scope(msg.trace);
+#endif
+				CompleteRequest(msg.header.correlation, std::move(msg));
+				return;
+			}
+
+			if (m_nDispatchMode == dispatch_mode::inline_io)
+			{
+#ifdef NET_TRACE_STAGES
+				// Messages sent from OnMessage() carry on from this one's trace
+				trace_scope scope(msg.trace);
+#endif
+				OnMessage(msg);
+				return;
+			}
+
+#ifdef NET_TRACE_STAGES
+			// From here on the application takes it, when it likes, so this is as far
+			// as it is traced
+			msg.trace.Stamp(trace_stage::enqueued);
+			stage_tracer::Get().RecordInbound(msg.trace);
+#endif
+
+#ifdef ASIO_HAS_CO_AWAIT
+			// A coroutine is waiting for it, so it can skip the queue
+			if (!m_qReceivers.empty())
+			{
+				receiver* pReceiver = m_qReceivers.front();
+				m_qReceivers.pop_front();
+				pReceiver->msg = std::move(msg);
+				pReceiver->timer.cancel();
+				return;
+			}
+#endif
+
+			m_qMessagesIn.emplace_back(nullptr, std::move(msg));
+		}
+
+		// Take a request out of the table and hand over its reply
+		void CompleteRequest(uint32_t nCorrelation, std::optional<message<T>> reply)
+		{
+			auto it = m_mapPendingRequests.find(nCorrelation);
+			if (it == m_mapPendingRequests.end())
+			{
+				return;
+			}
+
+			auto fnCallback = std::move(it->second.fnCallback);
+			it->second.timer.cancel();
+			m_mapPendingRequests.erase(it);
+			fnCallback(std::move(reply));
+		}
+
+	protected:
+		// The context the client made for itself, if it wasn't given one
+		std::unique_ptr<asio::io_context> m_pOwnContext;
+
 		// asio context handles the data transfer
-		asio::io_context m_context;
+		asio::io_context& m_context;
 
 		// That context needs a thread of its own to execute its work commands
 		std::thread thrContext;
 
 		// The client has a single instance of a "connection" object, which handles data transfer
-		std::unique_ptr<connection<T>> m_connection;
+		std::shared_ptr<connection<T>> m_connection;
+
+		// Given to the connection when it is made
+		header_filter<T> m_pfnHeaderFilter = nullptr;
+
+		// Given to the connection when it is made
+		queue_limits m_queueLimits;
+
+		// Given to the connection when it is made
+		connection_timeouts<T> m_timeouts;
+
+		// Where messages from the server go, see SetDispatchMode()
+		dispatch_mode m_nDispatchMode = dispatch_mode::queued;
+
+		// Counted into by the connection, on the io thread
+		metrics_shard<T> m_metrics;
 
 	private:
 		// This is the thread safe queue of incoming messages from server
-		tsqueue<owned_message<T>> m_qMessagesIn;
+		inbound_queue<owned_message<T>> m_qMessagesIn;
+
+		// Which of Incoming() and AsyncReceive() has been used to take from it. The
+		// queue may have just the one consumer, checked in debug builds
+		std::atomic<bool> m_bPolling = false;
+		std::atomic<bool> m_bAsyncReceiving = false;
+
+		// Requests waiting on a reply, by correlation ID. Only touched on the io thread
+		struct pending_request
+		{
+			std::function<void(std::optional<message<T>>)> fnCallback;
+			asio::steady_timer timer;
+		};
+
+		std::unordered_map<uint32_t, pending_request> m_mapPendingRequests;
+		std::atomic<uint32_t> m_nNextCorrelation = 1;
+
+#ifdef ASIO_HAS_CO_AWAIT
+		// A coroutine waiting in AsyncReceive(). Only touched on the io thread
+		struct receiver
+		{
+			asio::steady_timer timer;
+			std::optional<message<T>> msg;
+		};
+
+		std::deque<receiver*> m_qReceivers;
+#endif
 	};
 }
\ No newline at end of file
@@ -8,8 +8,18 @@
 #include <vector>
 #include <iostream>
 #include <algorithm>
+#include <cassert>
 #include <chrono>
 #include <cstdint>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <unordered_map>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #ifdef _WIN32
 #define _WIN32_WINNT 0x0A00
@@ -18,4 +28,19 @@
 #define ASIO_STANDALONE
 #include <asio.hpp>
 #include <asio/ts/buffer.hpp>
-#include <asio/ts/internet.hpp>
\ No newline at end of file
+#include <asio/ts/internet.hpp>
+
+namespace net
+{
+	// Tell the CPU we're in a spin loop, so it can ease off while we wait
+	inline void cpu_relax()
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		_mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#else
+		std::this_thread::yield();
+#endif
+	}
+}
\ No newline at end of file
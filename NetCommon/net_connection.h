@@ -2,15 +2,132 @@
 
 #include "net_common.h"
 #include "net_tsqueue.h"
+#include "net_mpscqueue.h"
 #include "net_message.h"
+#include "net_timerwheel.h"
+#include "net_metrics.h"
+#include "net_log.h"
 
 namespace net
 {
+	// Queue that incoming messages are handed over to the owner in. Define
+	// NET_MPSC_INBOUND to use the lock free queue rather than the locking one
+#ifdef NET_MPSC_INBOUND
+	template<typename T>
+	using inbound_queue = mpscqueue<T>;
+#else
+	template<typename T>
+	using inbound_queue = tsqueue<T>;
+#endif
+
+	// Where incoming messages are handled. queued hands them to the owner's thread
+	// through the inbound queue, to be dealt with in Update(). inline_io handles
+	// each one straight away on the io thread that read it, saving the hop between
+	// threads, but the handler then runs on the io threads and must be quick and
+	// safe to call from them
+	enum class dispatch_mode
+	{
+		queued,
+		inline_io
+	};
+
+	// What happens to a message sent to a connection whose outgoing queue is full
+	enum class backpressure_policy
+	{
+		// Wait until the queue drains to its low water mark. On the connection's own
+		// io thread waiting would never end, so there it drops the message instead
+		block,
+		// Queue the message, and make room by dropping the oldest messages that
+		// haven't started being written yet. If even that can't keep up, and the queue
+		// reaches twice its high water mark, the message is dropped after all
+		drop_oldest,
+		// Drop the message being sent
+		drop_newest,
+		// Give up on the remote, it isn't keeping up
+		disconnect
+	};
+
+	// Limits on a connection's outgoing queue. Once either high water mark is reached
+	// the queue is full, and it stays full until both are back down to their low
+	// water marks. Limits are checked as messages are sent, so with several threads
+	// sending at once they can be overshot by a message or two
+	struct queue_limits
+	{
+		size_t nHighWaterBytes = 16 * 1024 * 1024;
+		size_t nLowWaterBytes = 8 * 1024 * 1024;
+		size_t nHighWaterMessages = 64 * 1024;
+		size_t nLowWaterMessages = 32 * 1024;
+		backpressure_policy policy = backpressure_policy::disconnect;
+	};
+
+	// Deadlines on a connection, each of them off when zero. They are kept on the
+	// io thread's timer_wheel, so go off up to a tick (100ms) late.
+	//
+	// tHandshake is how long the remote gets to pass validation. tReadIdle closes the
+	// connection once nothing at all has been received for that long, and tWriteStall
+	// once a write has been stuck that long, the remote not reading. tHeartbeat sends
+	// an empty message with ID nHeartbeatID whenever nothing else has been sent for
+	// that long, which keeps a quiet connection from looking idle to the other end.
+	// nHeartbeatID has no default, as any ID picked for it would stop empty messages
+	// with that ID getting through; it must be set when tHeartbeat is.
+	// With heartbeats set on both ends, a read idle timeout of a few heartbeats finds
+	// remotes that have silently gone away. Heartbeats received by a connection that
+	// sends them itself are swallowed; one that doesn't hands them on like any other
+	// message
+	template<typename T>
+	struct connection_timeouts
+	{
+		std::chrono::milliseconds tHandshake{ 10000 };
+		std::chrono::milliseconds tReadIdle{ 0 };
+		std::chrono::milliseconds tWriteStall{ 0 };
+		std::chrono::milliseconds tHeartbeat{ 0 };
+		std::optional<T> nHeartbeatID;
+	};
+
+	// What became of a message handed to Send()
+	enum class send_status
+	{
+		// On its way
+		queued,
+		// Thrown away, the outgoing queue was full
+		dropped,
+		// Not sent, there is no connection (anymore)
+		disconnected
+	};
+
 	// Forward Decare
 	template<typename T>
 	class server_interface;
 
+	// An entry in a connection's outgoing queue. Either a message of its own, or a
+	// reference to a shared one that other connections are sending as well
+	template<typename T>
+	struct outbound_message
+	{
+		message<T> msg;
+		shared_message<T> shared;
+
+		// Sent with a conflation key, so a later message with the same key replaces
+		// this one if it hasn't been written yet
+		bool bConflate = false;
+		uint64_t nConflationKey = 0;
+
+		// Bytes this entry puts on the wire
+		size_t size() const
+		{
+			return shared ? shared.size() : sizeof(message_header<T>) + msg.body.size();
+		}
+	};
+
+
+	// Checks the header of each incoming message. Messages it returns false for are
+	// thrown away unread, before anything is allocated for them
+	template<typename T>
+	using header_filter = bool(*)(const message_header<T>&);
 
+	// Must be owned by a shared_ptr. Every piece of async work holds on to one, so a
+	// connection lives until the last of its work is done, even once its owner has
+	// let go of it
 	template<typename T>
 	class connection : public std::enable_shared_from_this<connection<T>>
 	{
@@ -23,10 +140,12 @@ namespace net
 			client
 		};
 
-		connection(owner parent, asio::io_context& asioContext, asio::ip::tcp::socket socket, tsqueue<owned_message<T>>& qIn)
-			: m_asioContext(asioContext), m_socket(std::move(socket)), m_qMessagesIn(qIn)
+		connection(owner parent, asio::io_context& asioContext, asio::ip::tcp::socket socket, inbound_queue<owned_message<T>>& qIn)
+			: m_socket(std::move(socket)), m_asioContext(asioContext), m_timerCork(asioContext), m_qMessagesIn(qIn),
+			m_wheel(asio::use_service<timer_wheel>(asioContext)), m_timerDeadline([this]() { CheckDeadlines(); })
 		{
 			m_nOwnerType = parent;
+			m_bOpen = m_socket.is_open();
 
 			// Get auth check data
 			if (m_nOwnerType == owner::server)
@@ -61,17 +180,30 @@ namespace net
 		{
 			if (m_nOwnerType == owner::server)
 			{
+				// Set even if the socket has already closed, so the server can still
+				// find this connection by ID to remove it
+				id = uid;
+				m_pServer = server;
+
 				if (m_socket.is_open())
 				{
-					id = uid;
 					// Was: ReadHeader();
 
-					// A client has attempted to connect to the server. So send them
-					// the handsahke_out to auth
-					WriteValidation();
+					// The socket lives on the context of one of the server's io threads, which
+					// may not be the thread calling this. Start the handshake from that context
+					// so everything touching this socket stays on one thread
+					asio::post(m_asioContext,
+						[this, self = this->shared_from_this(), server]()
+						{
+							StartDeadlines();
+
+							// A client has attempted to connect to the server. So send them
+							// the handsahke_out to auth
+							WriteValidation();
 
-					// Then, we wait asynchronously for the auth to be sent back
-					ReadValidation(server);
+							// Then, we wait asynchronously for the auth to be sent back
+							ReadValidation(server);
+						});
 				}
 			}
 		}
@@ -82,35 +214,42 @@ namespace net
 			// Only clients can connect to servers
 			if (m_nOwnerType == owner::client)
 			{
+				// Counts as connected while the attempt is under way
+				m_bOpen = true;
+
 				// Request asio attempts to connect to an endpoint
 				asio::async_connect(m_socket, endpoints,
-					[this](std::error_code ec, asio::ip::tcp::endpoint endpoint)
+					[this, self = this->shared_from_this()](std::error_code ec, asio::ip::tcp::endpoint endpoint)
 					{
 						if (!ec)
 						{
 							// Was: ReadHeader();
+							StartDeadlines();
 
 							// First thing server does is send packet to be
 							// authed. Wait for that and respond
 							ReadValidation();
 						}
+						else
+						{
+							CloseSocket(disconnect_reason::connect_failed);
+						}
 					});
 			}
 		}
 
-		// Called by servers or clients
+		// Called by servers or clients. Called from the connection's own context, the
+		// socket is closed straight away, and nothing more is read from it
 		void Disconnect()
 		{
-			if (IsConnected())
-			{
-				asio::post(m_asioContext, [this]() { m_socket.close(); });
-			}
+			Close(disconnect_reason::local);
 		}
 
-		// Returns if the connection is valid, open, and currently active
+		// Returns if the connection is valid, open, and currently active. Safe to call
+		// from any thread
 		bool IsConnected() const
 		{
-			return m_socket.is_open();
+			return m_bOpen.load(std::memory_order_acquire);
 		}
 
 		// Prime the connection to wait for incoming messages
@@ -119,158 +258,904 @@ namespace net
 
 		}
 
-	public:
-		void Send(const message<T>& msg)
+		// Hold back writes for up to tWindow after a message is sent, so that small
+		// messages sent close together go out in one write. The wait is cut short once
+		// nMaxBytes are waiting. A window of zero (the default) writes immidietly
+		void SetCorkWindow(std::chrono::microseconds tWindow, size_t nMaxBytes = 64 * 1024)
 		{
 			asio::post(m_asioContext,
-				[this, msg]()
+				[this, self = this->shared_from_this(), tWindow, nMaxBytes]()
 				{
-					// If the queue has messages in it, we assume it is in the process of
-					// being written to. If there are none, we start writing the messages
-					// at front of queue
-					bool bWritingMessage = !m_qMessagesOut.empty();
-					m_qMessagesOut.push_back(msg);
-					if (!bWritingMessage)
-					{
-						WriteHeader();
-					}
+					m_tCorkWindow = tWindow;
+					m_nCorkMaxBytes = nMaxBytes;
 				});
 		}
 
+		// Only let through messages the filter accepts. Must be set before the
+		// connection starts reading, the owner does this as it creates the connection
+		void SetHeaderFilter(header_filter<T> pfnFilter)
+		{
+			m_pfnHeaderFilter = pfnFilter;
+		}
+
+		// Hand incoming messages to fnHandler on the io thread instead of queueing them.
+		// Like the header filter, set before the connection starts reading
+		void SetMessageHandler(std::function<void(std::shared_ptr<connection<T>>, message<T>&)> fnHandler)
+		{
+			m_fnMessageHandler = std::move(fnHandler);
+		}
+
+		// Limit how much can pile up waiting to be written, and what happens beyond that.
+		// Set before anything is sent, the server does this as it accepts the connection
+		void SetQueueLimits(const queue_limits& limits)
+		{
+			m_limits = limits;
+		}
+
+		// Deadlines and heartbeats (see connection_timeouts). Set before the connection
+		// starts, the owner does this as it creates the connection
+		void SetTimeouts(const connection_timeouts<T>& timeouts)
+		{
+			assert((timeouts.tHeartbeat.count() == 0 || timeouts.nHeartbeatID) && "Heartbeats need an nHeartbeatID");
+			m_timeouts = timeouts;
+
+			// No ID to send them with, so no heartbeats
+			if (!m_timeouts.nHeartbeatID)
+			{
+				m_timeouts.tHeartbeat = std::chrono::milliseconds(0);
+			}
+		}
+
+		// Count into pMetrics as well as the connection's own counters. Set before the
+		// connection starts, and pMetrics must belong to the connection's io thread
+		void SetMetrics(metrics_shard<T>* pMetrics)
+		{
+			m_pMetrics = pMetrics;
+		}
+
+		// Also count this connection's traffic by message ID on its own. Off unless
+		// asked for, it takes four counters per message ID, 2KB a connection with the
+		// default of 64 IDs. Set before the connection starts
+		void SetTrafficMetrics(bool bEnabled)
+		{
+			m_pTraffic = bEnabled ? std::make_unique<message_counters<T>>() : nullptr;
+		}
+
+		// What has been counted on this connection alone. The write latency histogram
+		// is only kept for the whole server or client, so is empty here, as is the
+		// traffic unless SetTrafficMetrics() turned it on
+		metrics_snapshot<T> GetMetrics() const
+		{
+			metrics_snapshot<T> snapshot;
+			if (m_pTraffic)
+			{
+				m_pTraffic->AddTo(snapshot);
+			}
+			snapshot.nConnections = IsConnected() ? 1 : 0;
+			snapshot.nQueuedOutMessages = GetQueuedMessages();
+			snapshot.nQueuedOutBytes = GetQueuedBytes();
+			snapshot.nDropped = GetDroppedCount();
+			snapshot.nRejected = GetRejectedCount();
+			snapshot.nConflated = GetConflatedCount();
+
+			disconnect_reason nReason = GetDisconnectReason();
+			if (nReason != disconnect_reason::none)
+			{
+				snapshot.vDisconnects[size_t(nReason)] = 1;
+			}
+			return snapshot;
+		}
+
+		// Why the connection closed, none while it is still open
+		disconnect_reason GetDisconnectReason() const
+		{
+			return m_nDisconnectReason.load(std::memory_order_acquire);
+		}
+
+		// Messages and bytes sent but not yet written
+		size_t GetQueuedMessages() const
+		{
+			return m_nQueuedMessages.load(std::memory_order_relaxed);
+		}
+
+		size_t GetQueuedBytes() const
+		{
+			return m_nQueuedBytes.load(std::memory_order_relaxed);
+		}
+
+		// How many outgoing messages were dropped because the queue was full
+		uint64_t GetDroppedCount() const
+		{
+			return m_nMessagesDropped.load(std::memory_order_relaxed);
+		}
+
+		// How many incoming messages the header filter has thrown away
+		uint64_t GetRejectedCount() const
+		{
+			return m_nMessagesRejected.load(std::memory_order_relaxed);
+		}
+
+	public:
+		send_status Send(const message<T>& msg)
+		{
+			return Send(message<T>(msg));
+		}
+
+		// Send a message the caller is done with. It is moved all the way to the outgoing
+		// queue, so the body is never copied
+		send_status Send(message<T>&& msg)
+		{
+			send_status status = Admit(sizeof(message_header<T>) + msg.body.size());
+			if (status != send_status::queued)
+			{
+				return status;
+			}
+
+#ifdef NET_TRACE_STAGES
+			msg.trace.OnSend();
+#endif
+
+			asio::post(m_asioContext, make_pooled_handler(
+				[this, self = this->shared_from_this(), msg = std::move(msg)]() mutable
+				{
+					Enqueue({ std::move(msg), {} });
+				}));
+			return status;
+		}
+
+		// Send a message that has already been serialized. Only the reference is queued,
+		// the bytes themselves are shared with everyone else sending it
+		send_status Send(const shared_message<T>& msg)
+		{
+			send_status status = Admit(msg.size());
+			if (status != send_status::queued)
+			{
+				return status;
+			}
+
+			asio::post(m_asioContext, make_pooled_handler(
+				[this, self = this->shared_from_this(), msg]()
+				{
+					Enqueue({ {}, msg });
+				}));
+			return status;
+		}
+
+		// Send a message that only matters until a newer one with the same key comes
+		// along, such as the latest position of something. If one with the same key is
+		// still waiting to be written, this one takes its place rather than queueing
+		// behind it, so a client that has fallen behind skips the stale ones
+		send_status SendConflated(message<T>&& msg, uint64_t nKey)
+		{
+			send_status status = Admit(sizeof(message_header<T>) + msg.body.size());
+			if (status != send_status::queued)
+			{
+				return status;
+			}
+
+#ifdef NET_TRACE_STAGES
+			msg.trace.OnSend();
+#endif
+
+			asio::post(m_asioContext, make_pooled_handler(
+				[this, self = this->shared_from_this(), msg = std::move(msg), nKey]() mutable
+				{
+					Enqueue({ std::move(msg), {}, true, nKey });
+				}));
+			return status;
+		}
+
+		send_status SendConflated(const message<T>& msg, uint64_t nKey)
+		{
+			return SendConflated(message<T>(msg), nKey);
+		}
+
+		send_status SendConflated(const shared_message<T>& msg, uint64_t nKey)
+		{
+			send_status status = Admit(msg.size());
+			if (status != send_status::queued)
+			{
+				return status;
+			}
+
+			asio::post(m_asioContext, make_pooled_handler(
+				[this, self = this->shared_from_this(), msg, nKey]()
+				{
+					Enqueue({ {}, msg, true, nKey });
+				}));
+			return status;
+		}
+
+		// How many queued messages were replaced by newer ones with the same key
+		uint64_t GetConflatedCount() const
+		{
+			return m_nMessagesConflated.load(std::memory_order_relaxed);
+		}
+
 	private:
-		// ASYNC - Prime context ready to read a message header
-		void ReadHeader()
+		// Decide whether a message of nBytes can go in the outgoing queue, applying the
+		// backpressure policy if the queue is full. Counts it in if so
+		send_status Admit(size_t nBytes)
 		{
-			asio::async_read(m_socket, asio::buffer(&m_msgTemporaryIn.header, sizeof(message_header<T>)),
-				[this](std::error_code ec, std::size_t length)
+			// Nothing queued now would ever be written
+			if (!IsConnected())
+			{
+				return send_status::disconnected;
+			}
+
+			if (IsFull())
+			{
+				// Let the server know, once each time the queue fills up
+				if (!m_bBackpressure.exchange(true) && m_pServer)
 				{
-					if (!ec)
+					m_pServer->OnBackpressure(this->shared_from_this(), m_limits.policy);
+				}
+
+				switch (m_limits.policy)
+				{
+				case backpressure_policy::block:
+					if (m_asioContext.get_executor().running_in_this_thread())
 					{
-						// Header has been read, check if it has body
-						if (m_msgTemporaryIn.header.size > 0)
-						{
-							// If it does, allocate space in messages body vector and issue asio with
-							// task to read body
-							m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size);
-							ReadBody();
-						}
-						else
-						{
-							// If it doesn't, add decapitated message to connections incoming message queue
-							AddToIncomingMessageQueue();
-						}
+						m_nMessagesDropped++;
+						return send_status::dropped;
 					}
-					else
+					WaitForRoom();
+					if (!IsConnected())
 					{
-						std::cout << "[" << id << "] Read Header Fail.\n";
-						m_socket.close();
+						return send_status::disconnected;
 					}
-				});
+					break;
+
+				case backpressure_policy::drop_oldest:
+					// Room is made once it reaches the io thread. Should sending get that
+					// far ahead of the io thread that it can't keep up with the dropping,
+					// drop this one too rather than let memory run away
+					if (m_nQueuedBytes >= 2 * m_limits.nHighWaterBytes || m_nQueuedMessages >= 2 * m_limits.nHighWaterMessages)
+					{
+						m_nMessagesDropped++;
+						return send_status::dropped;
+					}
+					break;
+
+				case backpressure_policy::drop_newest:
+					m_nMessagesDropped++;
+					return send_status::dropped;
+
+				case backpressure_policy::disconnect:
+					NET_LOG_WARN("[", id, "] Outgoing Queue Full, Disconnecting.");
+					Close(disconnect_reason::queue_full);
+					return send_status::disconnected;
+				}
+			}
+
+			m_nQueuedBytes += nBytes;
+			m_nQueuedMessages++;
+			return send_status::queued;
+		}
+
+		bool IsFull() const
+		{
+			return m_nQueuedBytes >= m_limits.nHighWaterBytes || m_nQueuedMessages >= m_limits.nHighWaterMessages;
+		}
+
+		bool IsDrained() const
+		{
+			return m_nQueuedBytes <= m_limits.nLowWaterBytes && m_nQueuedMessages <= m_limits.nLowWaterMessages;
+		}
+
+		// Block the sending thread until the queue drains, or the connection goes. The
+		// connection can go without anyone being told, so check on it now and then
+		void WaitForRoom()
+		{
+			std::unique_lock<std::mutex> ul(m_muxBlocking);
+			m_nBlockedSenders++;
+			while (m_bBackpressure && IsConnected())
+			{
+				m_cvBlocking.wait_for(ul, std::chrono::milliseconds(10));
+			}
+			m_nBlockedSenders--;
 		}
 
-		// ASYNC - Prime conext ready to read a message body
-		void ReadBody()
+		// Messages and bytes have left the queue. Once below the low water marks the
+		// queue is no longer full, and anybody blocked can carry on
+		void OnQueueShrunk(size_t nMessages, size_t nBytes)
 		{
-			// Once a header has been read, this function is called to read body
-			asio::async_read(m_socket, asio::buffer(m_msgTemporaryIn.body.data(), m_msgTemporaryIn.body.size()),
-				[this](std::error_code ec, std::size_t length)
+			m_nQueuedMessages -= nMessages;
+			m_nQueuedBytes -= nBytes;
+
+			if (m_bBackpressure && IsDrained())
+			{
+				m_bBackpressure = false;
+				if (m_nBlockedSenders > 0)
 				{
-					if (!ec)
+					std::unique_lock<std::mutex> ul(m_muxBlocking);
+					m_cvBlocking.notify_all();
+				}
+			}
+		}
+
+		// Queue a message up, and get it written unless a write is already going, in
+		// which case it is picked up once that write finishes
+		void Enqueue(outbound_message<T>&& out)
+		{
+#ifdef NET_TRACE_STAGES
+			// Shared messages go to many connections at once, so aren't traced
+			if (!out.shared)
+			{
+				out.msg.trace.Stamp(trace_stage::write_queued);
+			}
+#endif
+
+			// Closed while this was on its way here
+			if (!IsConnected())
+			{
+				OnQueueShrunk(1, out.size());
+				return;
+			}
+
+			if (out.bConflate)
+			{
+				auto it = m_mapConflation.find(out.nConflationKey);
+				if (it != m_mapConflation.end())
+				{
+					// Overwrite the stale one where it stands. It was counted in, as was
+					// this one, so count it back out
+					outbound_message<T>& stale = m_qMessagesOut[size_t(it->second - m_nFrontSequence)];
+					size_t nStaleBytes = stale.size();
+					stale = std::move(out);
+					m_nMessagesConflated++;
+					OnQueueShrunk(1, nStaleBytes);
+					ScheduleWrite();
+					return;
+				}
+
+				m_mapConflation[out.nConflationKey] = m_nFrontSequence + m_qMessagesOut.size();
+			}
+
+			// Write latency is timed from the oldest message waiting
+			if (m_qMessagesOut.empty())
+			{
+				m_tQueuedSince = std::chrono::steady_clock::now();
+			}
+
+			m_qMessagesOut.push_back(std::move(out));
+			DropOldest();
+			ScheduleWrite();
+		}
+
+		// After a failed write, let go of everything that will now never be written,
+		// so the queue counts go back to nothing and blocked senders are let go
+		void DropUnwritten()
+		{
+			size_t nMessages = m_vMessagesWriting.size() + m_qMessagesOut.size();
+			size_t nBytes = 0;
+			for (const auto& out : m_vMessagesWriting)
+			{
+				nBytes += out.size();
+			}
+			for (const auto& out : m_qMessagesOut)
+			{
+				nBytes += out.size();
+			}
+
+			m_vMessagesWriting.clear();
+			m_nFrontSequence += m_qMessagesOut.size();
+			m_qMessagesOut.clear();
+			m_mapConflation.clear();
+			m_bWriting = false;
+			OnQueueShrunk(nMessages, nBytes);
+		}
+
+		// Take the message at the front of the queue off it
+		void PopFront()
+		{
+			const outbound_message<T>& out = m_qMessagesOut.front();
+			if (out.bConflate)
+			{
+				m_mapConflation.erase(out.nConflationKey);
+			}
+			m_qMessagesOut.pop_front();
+			m_nFrontSequence++;
+		}
+
+		// For the drop_oldest policy, make room by throwing away the oldest messages
+		// not yet being written, down to the low water marks. The one just sent stays
+		void DropOldest()
+		{
+			if (m_limits.policy != backpressure_policy::drop_oldest || !m_bBackpressure)
+			{
+				return;
+			}
+
+			size_t nMessages = 0;
+			size_t nBytes = 0;
+			while (m_qMessagesOut.size() > 1 &&
+				(m_nQueuedBytes - nBytes > m_limits.nLowWaterBytes || m_nQueuedMessages - nMessages > m_limits.nLowWaterMessages))
+			{
+				nBytes += m_qMessagesOut.front().size();
+				nMessages++;
+				PopFront();
+			}
+
+			m_nMessagesDropped += nMessages;
+			OnQueueShrunk(nMessages, nBytes);
+		}
+
+	private:
+		// Close the socket, from whichever thread, for nReason
+		void Close(disconnect_reason nReason)
+		{
+			if (IsConnected())
+			{
+				if (m_asioContext.get_executor().running_in_this_thread())
+				{
+					CloseSocket(nReason);
+				}
+				else
+				{
+					asio::post(m_asioContext, [this, self = this->shared_from_this(), nReason]() { CloseSocket(nReason); });
+				}
+			}
+		}
+
+		// Only called from the connection's own context
+		void CloseSocket(disconnect_reason nReason)
+		{
+			bool bWasOpen = m_bOpen.exchange(false, std::memory_order_acq_rel);
+			m_socket.close();
+			m_wheel.Cancel(m_timerDeadline);
+
+			if (bWasOpen)
+			{
+				m_nDisconnectReason.store(nReason, std::memory_order_release);
+				if (m_pMetrics)
+				{
+					m_pMetrics->vDisconnects[size_t(nReason)].Add();
+				}
+
+				// Let the server know straight away, rather than when it next sends to us
+				if (m_pServer)
+				{
+					m_pServer->OnClientClosed(this->shared_from_this());
+				}
+			}
+		}
+
+		void CountIn(const message_header<T>& header)
+		{
+			size_t nBytes = sizeof(message_header<T>) + header.size;
+			if (m_pTraffic)
+			{
+				m_pTraffic->CountIn(header.id, nBytes);
+			}
+			if (m_pMetrics)
+			{
+				m_pMetrics->traffic.CountIn(header.id, nBytes);
+			}
+		}
+
+		void CountOut(T id, size_t nBytes)
+		{
+			if (m_pTraffic)
+			{
+				m_pTraffic->CountOut(id, nBytes);
+			}
+			if (m_pMetrics)
+			{
+				m_pMetrics->traffic.CountOut(id, nBytes);
+			}
+		}
+
+		// Deadlines start counting once the socket is connected
+		void StartDeadlines()
+		{
+			m_tStarted = timer_wheel::clock::now();
+			m_tLastRead = m_tStarted;
+			m_tLastWrite = m_tStarted;
+			ScheduleDeadlines();
+		}
+
+		// Set the timer for whichever deadline is next, if there is one. Reads and
+		// writes only note the time, rather than moving the timer every time; when it
+		// goes off CheckDeadlines() works out whether anything is really due
+		void ScheduleDeadlines()
+		{
+			using clock = timer_wheel::clock;
+			clock::time_point tNext = clock::time_point::max();
+
+			if (m_timeouts.tHandshake.count() > 0 && !m_bHandshakeComplete)
+			{
+				tNext = std::min(tNext, m_tStarted + m_timeouts.tHandshake);
+			}
+			if (m_timeouts.tReadIdle.count() > 0)
+			{
+				tNext = std::min(tNext, m_tLastRead + m_timeouts.tReadIdle);
+			}
+			if (m_timeouts.tWriteStall.count() > 0 && m_bWriting)
+			{
+				tNext = std::min(tNext, m_tWriteStarted + m_timeouts.tWriteStall);
+			}
+			if (m_timeouts.tHeartbeat.count() > 0 && m_bHandshakeComplete)
+			{
+				tNext = std::min(tNext, m_tLastWrite + m_timeouts.tHeartbeat);
+			}
+
+			m_tNextDeadline = tNext;
+			if (tNext == clock::time_point::max())
+			{
+				m_wheel.Cancel(m_timerDeadline);
+			}
+			else if (IsConnected())
+			{
+				m_wheel.Schedule(m_timerDeadline, tNext, this->shared_from_this());
+			}
+		}
+
+		// The deadline timer has gone off
+		void CheckDeadlines()
+		{
+			if (!IsConnected())
+			{
+				return;
+			}
+
+			timer_wheel::clock::time_point tNow = timer_wheel::clock::now();
+
+			if (m_timeouts.tHandshake.count() > 0 && !m_bHandshakeComplete && tNow >= m_tStarted + m_timeouts.tHandshake)
+			{
+				NET_LOG_WARN("[", id, "] Handshake Timeout.");
+				CloseSocket(disconnect_reason::handshake_timeout);
+				return;
+			}
+			if (m_timeouts.tReadIdle.count() > 0 && tNow >= m_tLastRead + m_timeouts.tReadIdle)
+			{
+				NET_LOG_WARN("[", id, "] Read Timeout.");
+				CloseSocket(disconnect_reason::read_timeout);
+				return;
+			}
+			if (m_timeouts.tWriteStall.count() > 0 && m_bWriting && tNow >= m_tWriteStarted + m_timeouts.tWriteStall)
+			{
+				NET_LOG_WARN("[", id, "] Write Stalled.");
+				CloseSocket(disconnect_reason::write_stalled);
+				return;
+			}
+			if (m_timeouts.tHeartbeat.count() > 0 && m_bHandshakeComplete && tNow >= m_tLastWrite + m_timeouts.tHeartbeat)
+			{
+				// Counts as the last write from now, even before it goes
+				m_tLastWrite = tNow;
+				message<T> msg;
+				msg.header.id = *m_timeouts.nHeartbeatID;
+				Send(std::move(msg));
+			}
+
+			ScheduleDeadlines();
+		}
+
+		// ASYNC - Prime context ready to read whatever the remote has sent. Rather than
+		// reading a header and then a body, read as much as fits into the read buffer in
+		// one go and pull every complete message out of it
+		void ReadMessages()
+		{
+			// Shuffle any incomplete message left over from the last read to the front
+			// of the buffer, so the rest of it can be read in behind it
+			if (m_nReadStart > 0)
+			{
+				std::memmove(m_vReadBuffer.data(), m_vReadBuffer.data() + m_nReadStart, m_nReadEnd - m_nReadStart);
+				m_nReadEnd -= m_nReadStart;
+				m_nReadStart = 0;
+			}
+
+			// Normally the buffer is a fixed size, but a message too big to fit needs it
+			// to grow until that message has been read. It goes back to normal once big
+			// messages stop coming, not after each one, so a stream of them doesn't
+			// reallocate the buffer twice per message
+			size_t nNeeded = nReadBufferSize;
+			if (m_nDiscardBytes == 0 && m_nReadEnd >= sizeof(message_header<T>))
+			{
+				message_header<T> header;
+				std::memcpy(&header, m_vReadBuffer.data(), sizeof(message_header<T>));
+				nNeeded = std::max(nNeeded, sizeof(message_header<T>) + header.size);
+			}
+
+			if (m_vReadBuffer.size() < nNeeded)
+			{
+				m_vReadBuffer.resize(nNeeded);
+				m_nReadsOversized = 0;
+			}
+			else if (m_vReadBuffer.size() > nNeeded && m_nReadEnd == 0 && ++m_nReadsOversized > nShrinkAfterReads)
+			{
+				m_vReadBuffer.resize(nNeeded);
+				m_vReadBuffer.shrink_to_fit();
+				m_nReadsOversized = 0;
+			}
+
+			m_socket.async_read_some(asio::buffer(m_vReadBuffer.data() + m_nReadEnd, m_vReadBuffer.size() - m_nReadEnd),
+				make_pooled_handler([this, self = this->shared_from_this()](std::error_code ec, std::size_t length)
+				{
+					// A read that finished just as the socket was closed is dropped too
+					if (!ec && m_socket.is_open())
 					{
-						AddToIncomingMessageQueue();
+						m_nReadEnd += length;
+						if (m_nReadEnd > nReadBufferSize)
+						{
+							// The room the buffer grew by is still being used
+							m_nReadsOversized = 0;
+						}
+						m_tLastRead = timer_wheel::clock::now();
+#ifdef NET_TRACE_STAGES
+						m_nReadTicks = trace_clock::Now();
+#endif
+
+						// Handle every message that has fully arrived, then prime asio for more
+						ParseMessages();
+						ReadMessages();
 					}
 					else
 					{
-						std::cout << "[" << id << "] Read Body Fail.\n";
-						m_socket.close();
+						NET_LOG_INFO("[", id, "] Read Fail.");
+						CloseSocket(ec == asio::error::make_error_code(asio::error::eof) ? disconnect_reason::remote : disconnect_reason::read_failed);
 					}
-				});
+				}));
 		}
 
-		// ASYNC - Prime context to write a message header
-		void WriteHeader()
+		// Pull every complete message out of the read buffer. A message that has only
+		// partly arrived is left where it is, to be finished by the next read
+		void ParseMessages()
 		{
-			asio::async_write(m_socket, asio::buffer(&m_qMessagesOut.front().header, sizeof(message_header<T>)),
-				[this](std::error_code ec, std::size_t length)
+			while (true)
+			{
+				// Throw away the rest of a rejected message as it arrives
+				if (m_nDiscardBytes > 0)
 				{
-					if (!ec)
+					size_t nDiscard = std::min(m_nDiscardBytes, m_nReadEnd - m_nReadStart);
+					m_nReadStart += nDiscard;
+					m_nDiscardBytes -= nDiscard;
+					if (m_nDiscardBytes > 0)
 					{
-						if (m_qMessagesOut.front().body.size() > 0)
-						{
-							WriteBody();
-						}
-						else
-						{
-							m_qMessagesOut.pop_front();
+						break;
+					}
+				}
+
+				if (m_nReadEnd - m_nReadStart < sizeof(message_header<T>))
+				{
+					break;
+				}
+
+				message_header<T> header;
+				std::memcpy(&header, m_vReadBuffer.data() + m_nReadStart, sizeof(message_header<T>));
+
+				// Heartbeats have done their job just by arriving
+				if (m_timeouts.tHeartbeat.count() > 0 && header.id == *m_timeouts.nHeartbeatID && header.size == 0)
+				{
+					m_nReadStart += sizeof(message_header<T>);
+					CountIn(header);
+					continue;
+				}
+
+				// Not wanted, so skip the body without ever copying it. It doesn't need to
+				// have arrived yet, nor does the buffer need to grow to hold it
+				if (m_pfnHeaderFilter && !m_pfnHeaderFilter(header))
+				{
+					m_nReadStart += sizeof(message_header<T>);
+					m_nDiscardBytes = header.size;
+					m_nMessagesRejected.fetch_add(1, std::memory_order_relaxed);
+					continue;
+				}
+
+				// Wait for the rest of the body
+				size_t nMessageSize = sizeof(message_header<T>) + header.size;
+				if (m_nReadEnd - m_nReadStart < nMessageSize)
+				{
+					break;
+				}
+
+				// The one and only copy of the body, from the read buffer into the message.
+				// From here on the message is only ever moved
+				const uint8_t* pBody = m_vReadBuffer.data() + m_nReadStart + sizeof(message_header<T>);
+				message<T> msg;
+				msg.header = header;
+				msg.body.assign(pBody, pBody + header.size);
+				m_nReadStart += nMessageSize;
+				CountIn(header);
+#ifdef NET_TRACE_STAGES
+				msg.trace.Stamp(trace_stage::read_complete, m_nReadTicks);
+#endif
+
+				AddToIncomingMessageQueue(std::move(msg));
 
-							// Now check is Queue is empty. If not, write header again
-							if (!m_qMessagesOut.empty())
+				// A handler run inline may have closed the connection, in which case the
+				// rest of what was read is of no interest
+				if (m_fnMessageHandler && !IsConnected())
+				{
+					break;
+				}
+			}
+
+			// Everything was used up, so the next read can start at the front again
+			if (m_nReadStart == m_nReadEnd)
+			{
+				m_nReadStart = 0;
+				m_nReadEnd = 0;
+			}
+		}
+
+		// Start writing the outgoing queue if nothing is stopping us. Messages sent
+		// before the handshake is done are held back until it is, otherwise they would
+		// be interleaved with the auth packets
+		void ScheduleWrite()
+		{
+			if (m_bWriting || !m_bHandshakeComplete || m_qMessagesOut.empty())
+			{
+				return;
+			}
+
+			// Corked, give more messages the chance to join this write
+			if (m_tCorkWindow.count() > 0 && m_nQueuedBytes < m_nCorkMaxBytes)
+			{
+				if (!m_bCorked)
+				{
+					m_bCorked = true;
+					m_timerCork.expires_after(m_tCorkWindow);
+					m_timerCork.async_wait(
+						[this, self = this->shared_from_this()](std::error_code ec)
+						{
+							// Cancelled means the write was started early, nothing to do
+							if (!ec)
 							{
-								WriteHeader();
+								m_bCorked = false;
+								ScheduleWriteNow();
 							}
-						}
-					}
-					else
-					{
-						std::cout << "[" << id << "] Write Header Fail.\n";
-						m_socket.close();
-					}
-				});
+						});
+				}
+				return;
+			}
+
+			ScheduleWriteNow();
 		}
 
-		// ASYNC - Prime context to write a message body
-		void WriteBody()
+		// Write the outgoing queue without waiting on the cork window
+		void ScheduleWriteNow()
 		{
-			// If this function is called, a header has just been sent, and that header
-			// indicated a body existed for this message. Fill a transmission buffer
-			// with the body data, and send it
-			asio::async_write(m_socket, asio::buffer(m_qMessagesOut.front().body.data(), m_qMessagesOut.front().body.size()),
-				[this](std::error_code ec, std::size_t length)
+			if (m_bWriting || !m_bHandshakeComplete || m_qMessagesOut.empty())
+			{
+				return;
+			}
+
+			if (m_bCorked)
+			{
+				m_bCorked = false;
+				m_timerCork.cancel();
+			}
+
+			WriteMessages();
+		}
+
+		// ASYNC - Prime context to write every message in the outgoing queue. Headers
+		// and bodies are gathered into one buffer sequence, so the whole lot goes out
+		// in as few writes as the OS allows rather than two per message
+		void WriteMessages()
+		{
+			m_bWriting = true;
+
+			// The write stall deadline runs from here. Only move the timer if it would
+			// otherwise go off too late to notice
+			m_tWriteStarted = timer_wheel::clock::now();
+			m_tLastWrite = m_tWriteStarted;
+			if (m_timeouts.tWriteStall.count() > 0 && m_tNextDeadline > m_tWriteStarted + m_timeouts.tWriteStall)
+			{
+				ScheduleDeadlines();
+			}
+
+			// Take the whole queue for this write. From here on the queue is free to
+			// change (messages dropped, or added) without disturbing what's being written
+			for (auto& out : m_qMessagesOut)
+			{
+				m_vMessagesWriting.push_back(std::move(out));
+			}
+			m_nFrontSequence += m_qMessagesOut.size();
+			m_qMessagesOut.clear();
+			m_tWriteQueuedSince = m_tQueuedSince;
+
+			// Too late to replace any of these now
+			m_mapConflation.clear();
+
+			m_vWriteBuffers.clear();
+			for (auto& out : m_vMessagesWriting)
+			{
+				if (out.shared)
 				{
-					if (!ec)
+					// Already laid out exactly as it needs to go on the wire
+					m_vWriteBuffers.push_back(asio::buffer(out.shared.data(), out.shared.size()));
+				}
+				else
+				{
+					m_vWriteBuffers.push_back(asio::buffer(&out.msg.header, sizeof(message_header<T>)));
+					if (out.msg.body.size() > 0)
 					{
-						// Sending was successful, so we are done with the message
-						// and remove it from the queue
-						m_qMessagesOut.pop_front();
+						m_vWriteBuffers.push_back(asio::buffer(out.msg.body.data(), out.msg.body.size()));
+					}
+				}
+			}
 
-						// If the queue still has messages in it, then issue the task to 
-						// send the next messages' header.
-						if (!m_qMessagesOut.empty())
+			// asio copies the buffer sequence it's given, and copying the vector would cost
+			// a heap allocation per write. A pair of pointers into it copies for free
+			write_buffers buffers{ m_vWriteBuffers.data(), m_vWriteBuffers.data() + m_vWriteBuffers.size() };
+			asio::async_write(m_socket, buffers,
+				make_pooled_handler([this, self = this->shared_from_this()](std::error_code ec, std::size_t length)
+				{
+					if (!ec)
+					{
+						// Sending was successful, so we are done with the messages
+						for (const auto& out : m_vMessagesWriting)
 						{
-							WriteHeader();
+							CountOut(out.shared ? out.shared.header().id : out.msg.header.id, out.size());
 						}
+#ifdef NET_TRACE_STAGES
+						uint64_t nWritten = trace_clock::Now();
+						for (auto& out : m_vMessagesWriting)
+						{
+							if (!out.shared)
+							{
+								out.msg.trace.Stamp(trace_stage::write_complete, nWritten);
+								stage_tracer::Get().RecordOutbound(out.msg.trace);
+							}
+						}
+#endif
+						if (m_pMetrics)
+						{
+							m_pMetrics->writeLatency.Record(std::chrono::steady_clock::now() - m_tWriteQueuedSince);
+						}
+
+						size_t nMessages = m_vMessagesWriting.size();
+						m_vMessagesWriting.clear();
+						m_bWriting = false;
+						OnQueueShrunk(nMessages, length);
+
+						// If more were sent in the meantime, they've waited long enough
+						ScheduleWriteNow();
 					}
 					else
 					{
 						// Sending failed
-						std::cout << "[" << id << "] Write Body Fail.\n";
-						m_socket.close();
+						NET_LOG_WARN("[", id, "] Write Fail.");
+						CloseSocket(disconnect_reason::write_failed);
+						DropUnwritten();
 					}
-				});
+				}));
 		}
 
-		void AddToIncomingMessageQueue()
+		void AddToIncomingMessageQueue(message<T>&& msg)
 		{
+			// Handled right here, no queue involved
+			if (m_fnMessageHandler)
+			{
+				m_fnMessageHandler(m_nOwnerType == owner::server ? this->shared_from_this() : nullptr, msg);
+				return;
+			}
+
+#ifdef NET_TRACE_STAGES
+			msg.trace.Stamp(trace_stage::enqueued);
+#endif
+
 			// If the message is going to a server, you need to tag it with the name of the
 			// client who sent it
 			if (m_nOwnerType == owner::server)
 			{
-				m_qMessagesIn.push_back({ this->shared_from_this(), m_msgTemporaryIn });
+				m_qMessagesIn.emplace_back(this->shared_from_this(), std::move(msg));
 			}
 			// If the message is going to a client, there's only one server, no need to tag
 			else
 			{
-				m_qMessagesIn.push_back({ nullptr, m_msgTemporaryIn });
+				m_qMessagesIn.emplace_back(nullptr, std::move(msg));
 			}
 
-			// Prime asio for more work
-			ReadHeader();
 		}
 
 		// "Encrypt" data
 		uint64_t basicScrambler(uint64_t nInput)
 		{
-			uint64_t out = nInput ^ 0x12345678ABCD1234;
+			// Version 1 scrambles exactly as before there was a version
+			uint64_t out = nInput ^ 0x12345678ABCD1234 ^ (uint64_t(nProtocolVersion - 1) << 48);
 			out = (out & 0xF0F0F0F0F0F0F0F0) >> 4 | (out & 0x0F0F0F0F0F0F0F0F) << 4;
 			return out ^ 0x4321DCBA87654321;
 		}
@@ -279,30 +1164,41 @@ namespace net
 		void WriteValidation()
 		{
 			asio::async_write(m_socket, asio::buffer(&m_nHandshakeOut, sizeof(uint64_t)),
-				[this](std::error_code ec, std::size_t length)
+				[this, self = this->shared_from_this()](std::error_code ec, std::size_t length)
 				{
 					if (!ec)
 					{
 						// Auth data sent, clients should sit and wait for a response
 						if (m_nOwnerType == owner::client)
 						{
-							ReadHeader();
+							ReadMessages();
+							OnHandshakeComplete();
 						}
 					}
 					else
 					{
 						// Writing failed
-						std::cout << "[" << id << "] Write Validation Fail.\n";
-						m_socket.close();
+						NET_LOG_WARN("[", id, "] Write Validation Fail.");
+						CloseSocket(disconnect_reason::handshake_failed);
 					}
 				});
 		}
 
 
+		// Both sides are authed, start writing anything that was sent in the meantime
+		void OnHandshakeComplete()
+		{
+			m_bHandshakeComplete = true;
+
+			// No handshake deadline any more, but maybe a heartbeat
+			ScheduleDeadlines();
+			ScheduleWrite();
+		}
+
 		void ReadValidation(net::server_interface<T>* server = nullptr)
 		{
 			asio::async_read(m_socket, asio::buffer(&m_nHandshakeIn, sizeof(uint64_t)),
-				[this, server](std::error_code ec, std::size_t length)
+				[this, self = this->shared_from_this(), server](std::error_code ec, std::size_t length)
 				{
 					if (!ec)
 					{
@@ -312,16 +1208,17 @@ namespace net
 							if (m_nHandshakeIn == m_nHandshakeCheck)
 							{
 								// Client has sent correct auth, so connect
-								std::cout << "Client Validated\n";
+								NET_LOG_INFO("[", id, "] Client Validated");
 								server->OnClientValidated(this->shared_from_this());
 
 								// Now, sit and wait to receive data. Good Anton
-								ReadHeader();
+								ReadMessages();
+								OnHandshakeComplete();
 							}
 							else
 							{
-								std::cout << "Client Disconnected (Failed Auth)\n";
-								m_socket.close();
+								NET_LOG_WARN("[", id, "] Client Disconnected (Failed Auth)");
+								CloseSocket(disconnect_reason::handshake_failed);
 							}
 						}
 						else
@@ -336,8 +1233,8 @@ namespace net
 					else
 					{
 						// Sending failed
-						std::cout << "[" << id << "] Read Validation Fail.\n";
-						m_socket.close();
+						NET_LOG_WARN("[", id, "] Read Validation Fail.");
+						CloseSocket(disconnect_reason::handshake_failed);
 					}
 				});
 		}
@@ -347,17 +1244,91 @@ namespace net
 		// Each connection has a unique socket to a remote
 		asio::ip::tcp::socket m_socket;
 
-		// This context is shared with the whole asio instance
+		// Whether m_socket is open. The socket itself is only touched from the
+		// connection's context, this is what other threads look at
+		std::atomic<bool> m_bOpen = false;
+
+		// The context this connection's socket belongs to. All of the connection's
+		// async work runs on it, so it is never touched by two threads at once
 		asio::io_context& m_asioContext;
 
-		// This queue holds all messages to be sent to the remote side of connection
-		tsqueue<message<T>> m_qMessagesOut;
+		// This queue holds all messages to be sent to the remote side of connection.
+		// Only ever touched from the connection's context, so needs no locking
+		std::deque<outbound_message<T>, pool_allocator<outbound_message<T>>> m_qMessagesOut;
+
+		// Write state, again only touched from the connection's context. The messages
+		// being written are moved out of the queue, and mustn't move again until done
+		bool m_bWriting = false;
+		std::vector<outbound_message<T>> m_vMessagesWriting;
+		std::vector<asio::const_buffer> m_vWriteBuffers;
+
+		// m_vWriteBuffers as a buffer sequence, without owning them
+		struct write_buffers
+		{
+			using value_type = asio::const_buffer;
+			using const_iterator = const asio::const_buffer*;
+
+			const_iterator begin() const { return pBegin; }
+			const_iterator end() const { return pEnd; }
+
+			const asio::const_buffer* pBegin;
+			const asio::const_buffer* pEnd;
+		};
+
+		// Where in the queue the message with each conflation key is. Entries are
+		// numbered in the order they were queued, m_nFrontSequence being the front's
+		std::unordered_map<uint64_t, uint64_t> m_mapConflation;
+		uint64_t m_nFrontSequence = 0;
+		std::atomic<uint64_t> m_nMessagesConflated = 0;
+
+		// Everything sent but not yet written, including messages still on their way
+		// to the queue. Checked against the limits by whichever thread is sending
+		queue_limits m_limits;
+		std::atomic<size_t> m_nQueuedBytes = 0;
+		std::atomic<size_t> m_nQueuedMessages = 0;
+		std::atomic<uint64_t> m_nMessagesDropped = 0;
+
+		// Set once the queue fills, until it has drained to the low water marks
+		std::atomic<bool> m_bBackpressure = false;
+
+		// Senders blocked waiting for room, under the block policy
+		std::mutex m_muxBlocking;
+		std::condition_variable m_cvBlocking;
+		std::atomic<int> m_nBlockedSenders = 0;
+
+		// The server this connection belongs to, if it belongs to one
+		server_interface<T>* m_pServer = nullptr;
+
+		// Cork, lets small messages pile up briefly so they share a write
+		asio::steady_timer m_timerCork;
+		std::chrono::microseconds m_tCorkWindow{ 0 };
+		size_t m_nCorkMaxBytes = 64 * 1024;
+		bool m_bCorked = false;
 
 		// This queue holds all messages that have been recieved from the remote
 		// side of this connection. It is a reference as the "owner" of this connection
 		// is expected to provide a queue
-		tsqueue<owned_message<T>>& m_qMessagesIn;
-		message<T> m_msgTemporaryIn;
+		inbound_queue<owned_message<T>>& m_qMessagesIn;
+
+		// Read ahead buffer. Bytes from m_nReadStart up to m_nReadEnd have been received
+		// but not yet turned into messages
+		static constexpr size_t nReadBufferSize = 16 * 1024;
+		std::vector<uint8_t> m_vReadBuffer;
+		size_t m_nReadStart = 0;
+		size_t m_nReadEnd = 0;
+
+		// Reads in a row since the buffer last held more than its normal size. Past
+		// the limit it shrinks back to normal
+		static constexpr size_t nShrinkAfterReads = 64;
+		size_t m_nReadsOversized = 0;
+
+		// Filter on incoming headers, and how much of a rejected body is still to come
+		header_filter<T> m_pfnHeaderFilter = nullptr;
+		size_t m_nDiscardBytes = 0;
+		std::atomic<uint64_t> m_nMessagesRejected = 0;
+
+		// Set when messages are handled on the io thread, see dispatch_mode
+		std::function<void(std::shared_ptr<connection<T>>, message<T>&)> m_fnMessageHandler;
 
 		// The owner decides how some of the connection behaves
 		owner m_nOwnerType = owner::server;
@@ -367,5 +1338,33 @@ namespace net
 		uint64_t m_nHandshakeOut = 0;
 		uint64_t m_nHandshakeIn = 0;
 		uint64_t m_nHandshakeCheck = 0;
+
+		// Nothing but auth packets may be written until this is set
+		bool m_bHandshakeComplete = false;
+
+		// Deadlines, on the io thread's timer wheel. One timer covers all of them,
+		// set for whichever is next. Times are when each deadline's clock started
+		connection_timeouts<T> m_timeouts;
+		timer_wheel& m_wheel;
+		timer_wheel::timer m_timerDeadline;
+		timer_wheel::clock::time_point m_tNextDeadline = timer_wheel::clock::time_point::max();
+		timer_wheel::clock::time_point m_tStarted;
+		timer_wheel::clock::time_point m_tLastRead;
+		timer_wheel::clock::time_point m_tLastWrite;
+		timer_wheel::clock::time_point m_tWriteStarted;
+
+		// Counted on the io thread, into the connection's own counters, if it has
+		// them, and the shard its owner gave it. When the oldest message in the
+		// queue, and in the write under way, went into the queue
+		std::unique_ptr<message_counters<T>> m_pTraffic;
+		metrics_shard<T>* m_pMetrics = nullptr;
+		std::atomic<disconnect_reason> m_nDisconnectReason = disconnect_reason::none;
+		std::chrono::steady_clock::time_point m_tQueuedSince;
+		std::chrono::steady_clock::time_point m_tWriteQueuedSince;
+
+#ifdef NET_TRACE_STAGES
+		// When the last read finished, the read_complete stamp of what it brought in
+		uint64_t m_nReadTicks = 0;
+#endif
 	};
 }
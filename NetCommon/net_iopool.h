@@ -0,0 +1,98 @@
+#pragma once
+
+#include "net_common.h"
+
+namespace net
+{
+	// A pool of asio contexts, each one driven by exactly one thread. Anything bound
+	// to one of these contexts (sockets, timers, posted work) only ever runs on that
+	// context's thread, so it is serialized without needing a strand
+	class io_pool
+	{
+	public:
+		io_pool(size_t nThreads = 1)
+		{
+			// Always need at least one context, otherwise nothing can run
+			nThreads = std::max<size_t>(nThreads, 1);
+
+			for (size_t i = 0; i < nThreads; i++)
+			{
+				// Concurrency hint of 1 tells asio only one thread will ever call run()
+				m_vContexts.push_back(std::make_unique<asio::io_context>(1));
+			}
+		}
+
+		// Don't allow to be copied
+		io_pool(const io_pool&) = delete;
+
+		virtual ~io_pool()
+		{
+			Stop();
+		}
+
+	public:
+		// Give every context a thread of its own
+		void Start()
+		{
+			for (auto& context : m_vContexts)
+			{
+				// In case the pool has been stopped before
+				context->restart();
+
+				// Without work a context returns from run() immidietly, which would kill
+				// the thread of any context that has no sockets yet
+				m_vWorkGuards.emplace_back(asio::make_work_guard(*context));
+
+				asio::io_context* pContext = context.get();
+				m_vThreads.emplace_back([pContext]() { pContext->run(); });
+			}
+		}
+
+		// Stop every context and tidy up their threads
+		void Stop()
+		{
+			m_vWorkGuards.clear();
+
+			for (auto& context : m_vContexts)
+			{
+				context->stop();
+			}
+
+			for (auto& thread : m_vThreads)
+			{
+				if (thread.joinable())
+				{
+					thread.join();
+				}
+			}
+			m_vThreads.clear();
+		}
+
+		// Number of contexts (and threads) in the pool
+		size_t Size() const
+		{
+			return m_vContexts.size();
+		}
+
+		// Access a specific context
+		asio::io_context& GetContext(size_t nIndex)
+		{
+			return *m_vContexts[nIndex % m_vContexts.size()];
+		}
+
+		// Hand out contexts round robin, so work is spread evenly over the threads
+		asio::io_context& GetNextContext()
+		{
+			return GetContext(m_nNextContext.fetch_add(1, std::memory_order_relaxed));
+		}
+
+	protected:
+		// Contexts are held by pointer as asio::io_context can't be moved
+		std::vector<std::unique_ptr<asio::io_context>> m_vContexts;
+		std::vector<asio::executor_work_guard<asio::io_context::executor_type>> m_vWorkGuards;
+		std::vector<std::thread> m_vThreads;
+
+		// Which context the next caller of GetNextContext() receives
+		std::atomic<size_t> m_nNextContext = 0;
+	};
+}
@@ -0,0 +1,492 @@
+#pragma once
+
+#include "net_common.h"
+
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string_view>
+
+// Leveled logging that keeps I/O off the threads doing the logging
+
+// Lines below this level aren't compiled in at all. Define it before including
+// net.h, say to NET_LOG_LEVEL_WARN, to leave out everything quieter. The default
+// leaves out DEBUG and TRACE, which io threads would otherwise pay for on every
+// read and write
+#define NET_LOG_LEVEL_TRACE 0
+#define NET_LOG_LEVEL_DEBUG 1
+#define NET_LOG_LEVEL_INFO 2
+#define NET_LOG_LEVEL_WARN 3
+#define NET_LOG_LEVEL_ERROR 4
+#define NET_LOG_LEVEL_OFF 5
+
+#ifndef NET_LOG_LEVEL
+#define NET_LOG_LEVEL NET_LOG_LEVEL_INFO
+#endif
+
+// NET_LOG_INFO("[", id, "] Read Fail."), the arguments written one after the other
+// as with std::cout, and a new line after them
+#define NET_LOG(nLevel, ...) \
+	do \
+	{ \
+		if constexpr (int(nLevel) >= NET_LOG_LEVEL) \
+		{ \
+			if (net::logger::Get().IsEnabled(nLevel)) \
+			{ \
+				net::logger::Get().Log(nLevel, __VA_ARGS__); \
+			} \
+		} \
+	} while (false)
+
+#define NET_LOG_TRACE(...) NET_LOG(net::log_level::trace, __VA_ARGS__)
+#define NET_LOG_DEBUG(...) NET_LOG(net::log_level::debug, __VA_ARGS__)
+#define NET_LOG_INFO(...) NET_LOG(net::log_level::info, __VA_ARGS__)
+#define NET_LOG_WARN(...) NET_LOG(net::log_level::warn, __VA_ARGS__)
+#define NET_LOG_ERROR(...) NET_LOG(net::log_level::error, __VA_ARGS__)
+
+namespace net
+{
+	enum class log_level : int
+	{
+		trace = NET_LOG_LEVEL_TRACE,
+		debug = NET_LOG_LEVEL_DEBUG,
+		info = NET_LOG_LEVEL_INFO,
+		warn = NET_LOG_LEVEL_WARN,
+		error = NET_LOG_LEVEL_ERROR,
+		off = NET_LOG_LEVEL_OFF
+	};
+
+	// One line, not yet turned into text. The arguments are copied in as they are,
+	// along with the function that knows how to write them out
+	struct log_record
+	{
+		static constexpr size_t nPayload = 240;
+
+		void (*pfnFormat)(std::ostream&, const uint8_t*) = nullptr;
+		log_level nLevel = log_level::info;
+		alignas(8) uint8_t vPayload[nPayload];
+	};
+
+	// Lines logged by one thread, waiting for the logger's thread to write them.
+	// Only the thread it belongs to adds to it, and only the logger takes from it,
+	// so neither side ever waits for the other
+	class log_ring
+	{
+	public:
+		static constexpr size_t nSlots = 512;
+
+		// The next free record, or nullptr if the ring is full. Fill it in and Publish()
+		log_record* Claim()
+		{
+			size_t nHead = m_nHead.load(std::memory_order_relaxed);
+			if (nHead - m_nTail.load(std::memory_order_acquire) >= nSlots)
+			{
+				return nullptr;
+			}
+			return &m_vRecords[nHead % nSlots];
+		}
+
+		// Hand the claimed record over. Returns how many are now waiting
+		size_t Publish()
+		{
+			size_t nHead = m_nHead.load(std::memory_order_relaxed) + 1;
+			m_nHead.store(nHead, std::memory_order_release);
+			return nHead - m_nTail.load(std::memory_order_relaxed);
+		}
+
+		// Logger side. Call fn for every record waiting, oldest first
+		template<typename Fn>
+		void Drain(Fn fn)
+		{
+			size_t nTail = m_nTail.load(std::memory_order_relaxed);
+			size_t nHead = m_nHead.load(std::memory_order_acquire);
+			while (nTail != nHead)
+			{
+				fn(m_vRecords[nTail % nSlots]);
+				nTail++;
+			}
+			m_nTail.store(nTail, std::memory_order_release);
+		}
+
+		// Set when the thread it belongs to has finished. Once drained it can go
+		std::atomic<bool> m_bRetired = false;
+
+	private:
+		// Each side's index on a cache line of its own
+		alignas(64) std::atomic<size_t> m_nHead = 0;
+		alignas(64) std::atomic<size_t> m_nTail = 0;
+		std::array<log_record, nSlots> m_vRecords;
+	};
+
+	// Logging a line is a check of the level and a copy of the arguments into the
+	// calling thread's ring, no allocation or I/O. Turning them into text and writing
+	// it happens on the logger's own thread, which sleeps until there is something to
+	// write; only the line that wakes it takes a lock. Each line starts with its
+	// level, [WARN] and so on. Lines from one thread come out in order; lines from
+	// different threads can come out a little out of order with each other.
+	//
+	// Numbers and other trivially copyable arguments are copied as they are, and
+	// only written out later with their operator <<. Strings are copied in, cut
+	// short if a line would come to more than log_record::nPayload bytes. Anything
+	// else is turned into text there and then. Should a thread log faster than the
+	// logger writes, its ring fills and lines are dropped rather than wait
+	class logger
+	{
+	public:
+		// Never destroyed, so destructors of other statics can still log. Stopped
+		// when the program exits, see Stop()
+		static logger& Get()
+		{
+			static logger* pLogger = new logger();
+			return *pLogger;
+		}
+
+		// Lines below nLevel are thrown away. info unless set
+		void SetLevel(log_level nLevel)
+		{
+			m_nLevel.store(nLevel, std::memory_order_relaxed);
+		}
+
+		log_level GetLevel() const
+		{
+			return m_nLevel.load(std::memory_order_relaxed);
+		}
+
+		bool IsEnabled(log_level nLevel) const
+		{
+			return nLevel >= GetLevel() && nLevel != log_level::off;
+		}
+
+		// Where lines are written, std::cout unless set. Must outlive the logger, or
+		// be replaced before it goes
+		void SetOutput(std::ostream& os)
+		{
+			std::scoped_lock lock(m_muxWrite);
+			m_pOutput = &os;
+		}
+
+		// How many lines have been dropped because a ring was full
+		uint64_t GetDroppedCount() const
+		{
+			return m_nDropped.load(std::memory_order_relaxed);
+		}
+
+		// Use NET_LOG() and friends rather than calling this directly, so that lines
+		// below NET_LOG_LEVEL are compiled out
+		template<typename... Args>
+		void Log(log_level nLevel, const Args&... args)
+		{
+			static_assert(FixedSize<Args...>() <= log_record::nPayload, "Too much to log in one line");
+
+			log_ring& ring = GetRing();
+			log_record* pRecord = ring.Claim();
+			if (!pRecord)
+			{
+				m_nDropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+
+			pRecord->pfnFormat = &Format<stored_type<Args>...>;
+			pRecord->nLevel = nLevel;
+
+			// Strings share whatever room the fixed size arguments leave
+			size_t nSpare = log_record::nPayload - FixedSize<Args...>();
+			uint8_t* p = pRecord->vPayload;
+			((p = Encode(p, nSpare, args)), ...);
+
+			ring.Publish();
+
+			// Either the logger sees the line when it next drains, or this sees that it
+			// needs waking, never neither
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (m_bStopped.load(std::memory_order_relaxed))
+			{
+				// Nobody else is going to write it
+				Flush();
+			}
+			else if (!m_bPending.load(std::memory_order_relaxed) && !m_bPending.exchange(true, std::memory_order_relaxed))
+			{
+				Wake();
+			}
+		}
+
+		// Write out everything waiting and end the logger's thread. Lines logged after
+		// this are written straight away by the thread logging them. Called when the
+		// program exits, or sooner by hand
+		void Stop()
+		{
+			if (m_bStopped.exchange(true))
+			{
+				return;
+			}
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			// This wake mustn't be missed, as it's joined below, so take the lock. The
+			// logger's thread is then either waiting, and gets woken, or hasn't checked
+			// yet, and sees m_bStopped
+			{
+				std::scoped_lock lock(m_muxWake);
+			}
+			m_cvWake.notify_one();
+			if (m_thrWriter.joinable())
+			{
+				m_thrWriter.join();
+			}
+			Flush();
+		}
+
+		// Write out every line logged so far, by any thread, and flush the output
+		void Flush()
+		{
+			std::scoped_lock lock(m_muxWrite);
+
+			std::vector<std::shared_ptr<log_ring>> vRings;
+			{
+				std::scoped_lock lockRings(m_muxRings);
+				vRings = m_vRings;
+			}
+
+			bool bWrote = false;
+			std::vector<std::shared_ptr<log_ring>> vFinished;
+			for (auto& pRing : vRings)
+			{
+				// Checked before draining, so nothing can be added after the last drain
+				bool bRetired = pRing->m_bRetired.load(std::memory_order_acquire);
+
+				pRing->Drain([&](const log_record& record)
+					{
+						*m_pOutput << LevelName(record.nLevel);
+						record.pfnFormat(*m_pOutput, record.vPayload);
+						*m_pOutput << '\n';
+						bWrote = true;
+					});
+
+				if (bRetired)
+				{
+					vFinished.push_back(pRing);
+				}
+			}
+
+			uint64_t nDropped = GetDroppedCount();
+			if (nDropped != m_nDroppedReported)
+			{
+				*m_pOutput << "[LOG] " << (nDropped - m_nDroppedReported) << " lines dropped\n";
+				m_nDroppedReported = nDropped;
+				bWrote = true;
+			}
+
+			if (bWrote)
+			{
+				m_pOutput->flush();
+			}
+
+			if (!vFinished.empty())
+			{
+				std::scoped_lock lockRings(m_muxRings);
+				for (auto& pRing : vFinished)
+				{
+					m_vRings.erase(std::find(m_vRings.begin(), m_vRings.end(), pRing));
+				}
+			}
+		}
+
+	private:
+		logger()
+		{
+			m_thrWriter = std::thread([this]() { Run(); });
+			std::atexit([]() { Get().Stop(); });
+		}
+
+		// The logger's thread. Asleep until a line arrives, then writes out everything
+		// waiting
+		void Run()
+		{
+			while (true)
+			{
+				// Say we're going to sleep before looking one last time, so a line logged
+				// from here on knows to wake us
+				m_bSleeping.store(true, std::memory_order_seq_cst);
+				{
+					std::unique_lock<std::mutex> ul(m_muxWake);
+					auto fnReady = [this]()
+					{
+						return m_bPending.load(std::memory_order_seq_cst) || m_bStopped.load(std::memory_order_seq_cst);
+					};
+
+					// Wake() doesn't take the lock, so its notify can land just before we
+					// wait and be missed. Waking up now and then bounds how late that
+					// leaves a line
+					while (!fnReady())
+					{
+						m_cvWake.wait_for(ul, tMaxSleep);
+					}
+				}
+				m_bSleeping.store(false, std::memory_order_relaxed);
+
+				if (m_bStopped.load(std::memory_order_relaxed))
+				{
+					// Stop() does the last flush
+					return;
+				}
+
+				// Cleared before draining, so a line added after the drain has looked
+				// wakes us again
+				m_bPending.store(false, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				Flush();
+			}
+		}
+
+		// Called by logging threads, so takes no lock. The logger's thread only needs
+		// a notify if it's asleep, or about to be; otherwise it drains what's pending
+		// before it next sleeps
+		void Wake()
+		{
+			if (m_bSleeping.load(std::memory_order_seq_cst))
+			{
+				m_cvWake.notify_one();
+			}
+		}
+
+		static const char* LevelName(log_level nLevel)
+		{
+			switch (nLevel)
+			{
+			case log_level::trace: return "[TRACE] ";
+			case log_level::debug: return "[DEBUG] ";
+			case log_level::info: return "[INFO] ";
+			case log_level::warn: return "[WARN] ";
+			case log_level::error: return "[ERROR] ";
+			default: return "";
+			}
+		}
+
+		// Lets the logger know when a thread has finished with its ring
+		struct ring_holder
+		{
+			std::shared_ptr<log_ring> pRing;
+
+			~ring_holder()
+			{
+				if (pRing)
+				{
+					pRing->m_bRetired.store(true, std::memory_order_release);
+				}
+			}
+		};
+
+		// The calling thread's ring, made the first time it logs
+		log_ring& GetRing()
+		{
+			thread_local ring_holder holder;
+			if (!holder.pRing)
+			{
+				holder.pRing = std::shared_ptr<log_ring>(new log_ring());
+				std::scoped_lock lock(m_muxRings);
+				m_vRings.push_back(holder.pRing);
+			}
+			return *holder.pRing;
+		}
+
+		// Strings, and anything that can't simply be copied, are kept as text
+		template<typename Arg>
+		static constexpr bool is_text = std::is_convertible<const Arg&, std::string_view>::value;
+
+		template<typename Arg>
+		using stored_type = std::conditional_t<is_text<Arg> || !std::is_trivially_copyable<std::decay_t<Arg>>::value,
+			std::string_view, std::decay_t<Arg>>;
+
+		// Bytes a line needs whatever its strings hold, a length for each string
+		template<typename... Args>
+		static constexpr size_t FixedSize()
+		{
+			return (size_t(0) + ... + (std::is_same<stored_type<Args>, std::string_view>::value ? sizeof(uint16_t) : sizeof(stored_type<Args>)));
+		}
+
+		static uint8_t* EncodeText(uint8_t* p, size_t& nSpare, std::string_view sText)
+		{
+			uint16_t nLength = uint16_t(std::min({ sText.size(), nSpare, size_t(UINT16_MAX) }));
+			nSpare -= nLength;
+			std::memcpy(p, &nLength, sizeof(uint16_t));
+			std::memcpy(p + sizeof(uint16_t), sText.data(), nLength);
+			return p + sizeof(uint16_t) + nLength;
+		}
+
+		template<typename Arg>
+		static uint8_t* Encode(uint8_t* p, size_t& nSpare, const Arg& arg)
+		{
+			if constexpr (std::is_pointer<Arg>::value && is_text<Arg>)
+			{
+				return EncodeText(p, nSpare, arg ? std::string_view(arg) : std::string_view("(null)"));
+			}
+			else if constexpr (is_text<Arg>)
+			{
+				return EncodeText(p, nSpare, std::string_view(arg));
+			}
+			else if constexpr (std::is_trivially_copyable<Arg>::value)
+			{
+				std::memcpy(p, &arg, sizeof(Arg));
+				return p + sizeof(Arg);
+			}
+			else
+			{
+				std::ostringstream os;
+				os << arg;
+				return EncodeText(p, nSpare, os.str());
+			}
+		}
+
+		template<typename Stored>
+		static const uint8_t* Decode(std::ostream& os, const uint8_t* p)
+		{
+			if constexpr (std::is_same<Stored, std::string_view>::value)
+			{
+				uint16_t nLength;
+				std::memcpy(&nLength, p, sizeof(uint16_t));
+				os.write(reinterpret_cast<const char*>(p + sizeof(uint16_t)), nLength);
+				return p + sizeof(uint16_t) + nLength;
+			}
+			else
+			{
+				alignas(Stored) unsigned char vValue[sizeof(Stored)];
+				std::memcpy(vValue, p, sizeof(Stored));
+				os << *std::launder(reinterpret_cast<const Stored*>(vValue));
+				return p + sizeof(Stored);
+			}
+		}
+
+		// Written out on the logger's thread, the arguments in the order they were given
+		template<typename... Stored>
+		static void Format(std::ostream& os, const uint8_t* p)
+		{
+			((p = Decode<Stored>(os, p)), ...);
+		}
+
+	private:
+		std::atomic<log_level> m_nLevel = log_level::info;
+		std::atomic<uint64_t> m_nDropped = 0;
+
+		// Every thread's ring, including those of threads that have finished but
+		// still have lines waiting
+		std::mutex m_muxRings;
+		std::vector<std::shared_ptr<log_ring>> m_vRings;
+
+		// Held while writing, so only one thread drains the rings at a time
+		std::mutex m_muxWrite;
+		std::ostream* m_pOutput = &std::cout;
+		uint64_t m_nDroppedReported = 0;
+
+		// The logger's thread, and what wakes it: a line waiting or Stop()
+		std::thread m_thrWriter;
+		std::mutex m_muxWake;
+		std::condition_variable m_cvWake;
+		std::atomic<bool> m_bPending = false;
+		std::atomic<bool> m_bStopped = false;
+		std::atomic<bool> m_bSleeping = false;
+
+		// Longest the logger's thread sleeps without looking for lines, in case a
+		// wake was missed
+		static constexpr std::chrono::milliseconds tMaxSleep{ 50 };
+	};
+}
@@ -1,8 +1,23 @@
 #pragma once
 #include "net_common.h"
+#include "net_pool.h"
+
+#ifdef NET_TRACE_STAGES
+#include "net_trace.h"
+#endif
 
 namespace net
 {
+	// Message bodies are drawn from the buffer pool, so a steady flow of messages
+	// reuses the same memory rather than going back to the heap every time
+	using message_body = pooled_buffer;
+
+	// Version of the framing, bumped whenever message_header changes. 1 was the
+	// original id and size, 2 added correlation, four more bytes on every message.
+	// It goes into the handshake, so peers built against different versions fail
+	// to connect rather than misread each other's headers
+	constexpr uint32_t nProtocolVersion = 2;
+
 	// Message header is sent at start of all messages. The
 	// Template allows the use of "enum class" to ensure 
 	// messages are valid at compile time
@@ -11,13 +26,21 @@ namespace net
 	{
 		T id{};
 		uint32_t size = 0;
+
+		// Ties a reply to the request it answers. Zero for messages that are neither
+		uint32_t correlation = 0;
 	};
 
 	template <typename T>
 	struct message
 	{
 		message_header<T> header{};
-		std::vector<uint8_t> body;
+		message_body body;
+
+#ifdef NET_TRACE_STAGES
+		// Where the message has been and when, see net_trace.h. Never sent
+		message_trace trace;
+#endif
 
 		// Return size of entire message packet in bytes
 		size_t size() const
@@ -78,6 +101,61 @@ namespace net
 		}
 	};
 
+	// A message serialized once into a single buffer, header and body back to back, that
+	// any number of connections can send. Copying one only copies a pointer, so a
+	// broadcast costs one serialization however many clients it goes to. Can't be
+	// changed once made, as other connections may be in the middle of writing it
+	template <typename T>
+	class shared_message
+	{
+	public:
+		shared_message() = default;
+
+		explicit shared_message(const message<T>& msg)
+		{
+			// Control block and all come from the buffer pool
+			auto pData = std::allocate_shared<message_body>(pool_allocator<message_body>());
+			pData->resize(sizeof(message_header<T>) + msg.body.size());
+			std::memcpy(pData->data(), &msg.header, sizeof(message_header<T>));
+			if (msg.body.size() > 0)
+			{
+				std::memcpy(pData->data() + sizeof(message_header<T>), msg.body.data(), msg.body.size());
+			}
+			m_pData = std::move(pData);
+		}
+
+		// The serialized message, exactly as it goes on the wire
+		const uint8_t* data() const
+		{
+			return m_pData ? m_pData->data() : nullptr;
+		}
+
+		// Size of the entire serialized message in bytes, header included
+		size_t size() const
+		{
+			return m_pData ? m_pData->size() : 0;
+		}
+
+		// A copy of the header at the front of the buffer
+		message_header<T> header() const
+		{
+			message_header<T> header{};
+			if (m_pData)
+			{
+				std::memcpy(&header, m_pData->data(), sizeof(message_header<T>));
+			}
+			return header;
+		}
+
+		explicit operator bool() const
+		{
+			return m_pData != nullptr;
+		}
+
+	private:
+		std::shared_ptr<const message_body> m_pData;
+	};
+
 	// Forward declare the connect
 	template <typename T>
 	class connection;
@@ -90,6 +168,13 @@ namespace net
 		std::shared_ptr<connection<T>> remote = nullptr;
 		message<T> msg;
 
+		owned_message() = default;
+
+		// Takes the message by value, so a caller can move it in without a copy
+		owned_message(std::shared_ptr<connection<T>> pRemote, message<T> message)
+			: remote(std::move(pRemote)), msg(std::move(message))
+		{}
+
 		// Once more, a friendly little string maker
 		friend std::ostream& operator << (std::ostream& os, const owned_message<T>& msg)
 		{
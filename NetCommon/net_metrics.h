@@ -0,0 +1,303 @@
+#pragma once
+
+#include "net_common.h"
+
+#include <array>
+
+// Counters and latency histograms, cheap enough to leave on all the time
+
+namespace net
+{
+	// How many message IDs get counters of their own, IDs from there up share the
+	// last one. 64, unless the enum has a MessageTypeCount entry after its real IDs,
+	// or this is specialized for it
+	template<typename T, typename = void>
+	struct message_type_count : std::integral_constant<size_t, 64>
+	{};
+
+	template<typename T>
+	struct message_type_count<T, std::void_t<decltype(T::MessageTypeCount)>>
+		: std::integral_constant<size_t, size_t(T::MessageTypeCount) + 1>
+	{};
+
+	// Why a connection closed. Only the first reason counts, whatever else fails
+	// as a result of closing is ignored
+	enum class disconnect_reason : uint32_t
+	{
+		// Still open
+		none,
+		// Its owner called Disconnect()
+		local,
+		// The remote closed the connection
+		remote,
+		// The client couldn't connect to the server
+		connect_failed,
+		// The handshake was answered wrongly, or failed to send or arrive
+		handshake_failed,
+		handshake_timeout,
+		read_failed,
+		write_failed,
+		read_timeout,
+		write_stalled,
+		// The outgoing queue filled up, under backpressure_policy::disconnect
+		queue_full,
+
+		count
+	};
+
+	// A counter only ever changed by one thread, a connection's io thread, and read
+	// from any. Adding is a plain load and store rather than a locked add, so it costs
+	// next to nothing
+	class metric_counter
+	{
+	public:
+		void Add(uint64_t n = 1)
+		{
+			m_nValue.store(m_nValue.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+
+		uint64_t Get() const
+		{
+			return m_nValue.load(std::memory_order_relaxed);
+		}
+
+	private:
+		std::atomic<uint64_t> m_nValue = 0;
+	};
+
+	// What a latency_histogram held at one point, as plain numbers
+	struct histogram_snapshot
+	{
+		// Microseconds. Up to 4 are counted exactly, then each doubling is split
+		// into 4 buckets, so a bucket is never more than 25% wide
+		static constexpr size_t nSubBits = 2;
+		static constexpr size_t nSubBuckets = size_t(1) << nSubBits;
+		static constexpr size_t nBuckets = 40 * nSubBuckets;
+
+		std::array<uint64_t, nBuckets> vBuckets{};
+
+		static size_t BucketOf(uint64_t nMicroseconds)
+		{
+			if (nMicroseconds < nSubBuckets)
+			{
+				return size_t(nMicroseconds);
+			}
+
+			size_t nBit = HighestBit(nMicroseconds);
+			size_t nBucket = (nBit - nSubBits + 1) * nSubBuckets + size_t((nMicroseconds >> (nBit - nSubBits)) & (nSubBuckets - 1));
+			return std::min(nBucket, nBuckets - 1);
+		}
+
+		// Smallest time that lands in the bucket
+		static uint64_t LowerBound(size_t nBucket)
+		{
+			if (nBucket < nSubBuckets)
+			{
+				return nBucket;
+			}
+
+			size_t nBit = nBucket / nSubBuckets + nSubBits - 1;
+			return uint64_t(nSubBuckets + nBucket % nSubBuckets) << (nBit - nSubBits);
+		}
+
+		uint64_t Count() const
+		{
+			uint64_t nCount = 0;
+			for (uint64_t n : vBuckets)
+			{
+				nCount += n;
+			}
+			return nCount;
+		}
+
+		// Roughly the time dFraction of everything recorded was within, in
+		// microseconds. Percentile(0.99) is the p99
+		uint64_t Percentile(double dFraction) const
+		{
+			uint64_t nCount = Count();
+			if (nCount == 0)
+			{
+				return 0;
+			}
+
+			uint64_t nTarget = std::max<uint64_t>(1, uint64_t(dFraction * double(nCount) + 0.5));
+			uint64_t nSeen = 0;
+			for (size_t i = 0; i < nBuckets; i++)
+			{
+				nSeen += vBuckets[i];
+				if (nSeen >= nTarget)
+				{
+					return LowerBound(i);
+				}
+			}
+			return LowerBound(nBuckets - 1);
+		}
+
+		histogram_snapshot& operator += (const histogram_snapshot& other)
+		{
+			for (size_t i = 0; i < nBuckets; i++)
+			{
+				vBuckets[i] += other.vBuckets[i];
+			}
+			return *this;
+		}
+
+	private:
+		static size_t HighestBit(uint64_t n)
+		{
+#if defined(_MSC_VER) && defined(_M_X64)
+			unsigned long nBit;
+			_BitScanReverse64(&nBit, n);
+			return size_t(nBit);
+#elif defined(__GNUC__) || defined(__clang__)
+			return size_t(63 - __builtin_clzll(n));
+#else
+			size_t nBit = 0;
+			while (n >>= 1)
+			{
+				nBit++;
+			}
+			return nBit;
+#endif
+		}
+	};
+
+	// Times, counted into buckets by how long they were. Like metric_counter, only
+	// recorded into by one thread
+	class latency_histogram
+	{
+	public:
+		void Record(std::chrono::steady_clock::duration tLatency)
+		{
+			auto nMicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(tLatency).count();
+			m_vBuckets[histogram_snapshot::BucketOf(uint64_t(std::max<int64_t>(nMicroseconds, 0)))].Add();
+		}
+
+		void AddTo(histogram_snapshot& snapshot) const
+		{
+			for (size_t i = 0; i < histogram_snapshot::nBuckets; i++)
+			{
+				snapshot.vBuckets[i] += m_vBuckets[i].Get();
+			}
+		}
+
+	private:
+		std::array<metric_counter, histogram_snapshot::nBuckets> m_vBuckets;
+	};
+
+	// Everything counted about a connection, or a whole server, at one point. Plain
+	// numbers, so it can be sent as it is, msg << snapshot, and read back on the
+	// other end with msg >> snapshot
+	template<typename T>
+	struct metrics_snapshot
+	{
+		static constexpr size_t nTypes = message_type_count<T>::value;
+
+		// Messages and bytes (header included) read and written, by message ID
+		std::array<uint64_t, nTypes> vMessagesIn{};
+		std::array<uint64_t, nTypes> vBytesIn{};
+		std::array<uint64_t, nTypes> vMessagesOut{};
+		std::array<uint64_t, nTypes> vBytesOut{};
+
+		// Connections open now, ever accepted, and ever closed by reason
+		uint64_t nConnections = 0;
+		uint64_t nAccepted = 0;
+		std::array<uint64_t, size_t(disconnect_reason::count)> vDisconnects{};
+
+		// Outgoing queues, waiting to be written, and incoming messages waiting to be
+		// handled in Update()
+		uint64_t nQueuedOutMessages = 0;
+		uint64_t nQueuedOutBytes = 0;
+		uint64_t nQueuedInMessages = 0;
+
+		// Outgoing messages dropped, incoming ones thrown away by the header filter,
+		// and queued ones replaced by conflation
+		uint64_t nDropped = 0;
+		uint64_t nRejected = 0;
+		uint64_t nConflated = 0;
+
+		// How long written messages waited, from the oldest in each write going into
+		// the outgoing queue until the write finished
+		histogram_snapshot writeLatency;
+
+		static uint64_t Total(const std::array<uint64_t, nTypes>& vCounts)
+		{
+			uint64_t nTotal = 0;
+			for (uint64_t n : vCounts)
+			{
+				nTotal += n;
+			}
+			return nTotal;
+		}
+
+		uint64_t HandshakeFailures() const
+		{
+			return vDisconnects[size_t(disconnect_reason::handshake_failed)] + vDisconnects[size_t(disconnect_reason::handshake_timeout)];
+		}
+	};
+
+	// Messages and bytes each way, by message ID
+	template<typename T>
+	class message_counters
+	{
+	public:
+		static constexpr size_t nTypes = message_type_count<T>::value;
+
+		void CountIn(T id, size_t nBytes)
+		{
+			m_vMessagesIn[Index(id)].Add();
+			m_vBytesIn[Index(id)].Add(nBytes);
+		}
+
+		void CountOut(T id, size_t nBytes)
+		{
+			m_vMessagesOut[Index(id)].Add();
+			m_vBytesOut[Index(id)].Add(nBytes);
+		}
+
+		void AddTo(metrics_snapshot<T>& snapshot) const
+		{
+			for (size_t i = 0; i < nTypes; i++)
+			{
+				snapshot.vMessagesIn[i] += m_vMessagesIn[i].Get();
+				snapshot.vBytesIn[i] += m_vBytesIn[i].Get();
+				snapshot.vMessagesOut[i] += m_vMessagesOut[i].Get();
+				snapshot.vBytesOut[i] += m_vBytesOut[i].Get();
+			}
+		}
+
+	private:
+		static size_t Index(T id)
+		{
+			return std::min(size_t(id), nTypes - 1);
+		}
+
+		std::array<metric_counter, nTypes> m_vMessagesIn;
+		std::array<metric_counter, nTypes> m_vBytesIn;
+		std::array<metric_counter, nTypes> m_vMessagesOut;
+		std::array<metric_counter, nTypes> m_vBytesOut;
+	};
+
+	// What one io thread counts for its owner, over every connection it has ever
+	// run. Each thread has its own, starting on a cache line of its own, so threads
+	// counting at the same time never fight over a line. Added up when read
+	template<typename T>
+	struct alignas(64) metrics_shard
+	{
+		message_counters<T> traffic;
+		metric_counter nAccepted;
+		std::array<metric_counter, size_t(disconnect_reason::count)> vDisconnects;
+		latency_histogram writeLatency;
+
+		void AddTo(metrics_snapshot<T>& snapshot) const
+		{
+			traffic.AddTo(snapshot);
+			snapshot.nAccepted += nAccepted.Get();
+			for (size_t i = 0; i < vDisconnects.size(); i++)
+			{
+				snapshot.vDisconnects[i] += vDisconnects[i].Get();
+			}
+			writeLatency.AddTo(snapshot.writeLatency);
+		}
+	};
+}
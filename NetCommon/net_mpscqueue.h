@@ -0,0 +1,236 @@
+#pragma once
+
+#include "net_common.h"
+#include "net_pool.h"
+
+// Lock free multiple producer, single consumer queue
+
+namespace net
+{
+	// Any number of threads may push, but only one thread may pop (or call empty(),
+	// front(), clear() or wait()). That is exactly how incoming messages flow: many io
+	// threads pushing, one thread calling Update(). Pushing is a single atomic exchange,
+	// and nothing on either side ever takes a lock unless the consumer is asleep
+	template<typename T>
+	class mpscqueue
+	{
+	public:
+		mpscqueue()
+		{
+			// The queue always holds one spent node, so producers and consumer never
+			// touch the same node unless the queue is empty
+			m_pTail = NewNode();
+			m_pHead.store(m_pTail, std::memory_order_relaxed);
+		}
+
+		// Don't allow to be copied
+		mpscqueue(const mpscqueue<T>&) = delete;
+
+		virtual ~mpscqueue()
+		{
+			clear();
+			DeleteNode(m_pTail);
+		}
+
+	public:
+		// Adds an item to the back of Queue. Safe from any thread
+		void push_back(const T& item)
+		{
+			push(NewNode(item));
+		}
+
+		// Adds an item to the back of Queue, moving it in. Safe from any thread
+		void push_back(T&& item)
+		{
+			push(NewNode(std::move(item)));
+		}
+
+		// Constructs an item in place at the back of Queue. Safe from any thread
+		template<typename... Args>
+		void emplace_back(Args&&... args)
+		{
+			push(NewNode(std::in_place, std::forward<Args>(args)...));
+		}
+
+		// Returns true if Queue has no items. Consumer only
+		bool empty()
+		{
+			return m_pTail->next.load(std::memory_order_acquire) == nullptr;
+		}
+
+		// Returns number of items in Queue. Only a snapshot if others are pushing
+		size_t count()
+		{
+			return m_nPushed.load(std::memory_order_relaxed) - m_nPopped.load(std::memory_order_relaxed);
+		}
+
+		// Clear queue. Consumer only
+		void clear()
+		{
+			while (!empty())
+			{
+				pop_front();
+			}
+		}
+
+		// Returns and maintains item at front of Queue. Consumer only
+		const T& front()
+		{
+			return *m_pTail->next.load(std::memory_order_acquire)->item;
+		}
+
+		// Remove and return item from front of queue. Consumer only, and the queue
+		// must not be empty
+		T pop_front()
+		{
+			node* pFront = m_pTail->next.load(std::memory_order_acquire);
+
+			// The front node becomes the new spent node, so take its item out
+			T t = std::move(*pFront->item);
+			pFront->item.reset();
+
+			DeleteNode(m_pTail);
+			m_pTail = pFront;
+			m_nPopped.store(m_nPopped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return t;
+		}
+
+		// Pop up to nMaxItems onto the back of a container. Consumer only. Returns how
+		// many were moved
+		template<typename Container>
+		size_t drain_into(Container& container, size_t nMaxItems = -1)
+		{
+			size_t nCount = 0;
+			while (nCount < nMaxItems && !empty())
+			{
+				container.push_back(pop_front());
+				nCount++;
+			}
+			return nCount;
+		}
+
+		// Block until there is something to pop. Consumer only
+		void wait()
+		{
+			if (spin())
+			{
+				return;
+			}
+
+			std::unique_lock<std::mutex> ul(muxBlocking);
+			m_nSleepers.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			cvBlocking.wait(ul, [this]() { return !empty(); });
+			m_nSleepers.fetch_sub(1);
+		}
+
+		// Block until there is something to pop, or the deadline passes. Consumer only.
+		// Returns false if it timed out with the queue still empty
+		template<typename Clock, typename Duration>
+		bool wait_until(const std::chrono::time_point<Clock, Duration>& tDeadline)
+		{
+			if (spin())
+			{
+				return true;
+			}
+
+			std::unique_lock<std::mutex> ul(muxBlocking);
+			m_nSleepers.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			bool bReady = cvBlocking.wait_until(ul, tDeadline, [this]() { return !empty(); });
+			m_nSleepers.fetch_sub(1);
+			return bReady;
+		}
+
+		// Block until there is something to pop, or the time runs out. Consumer only.
+		// Returns false if it timed out with the queue still empty
+		template<typename Rep, typename Period>
+		bool wait_for(const std::chrono::duration<Rep, Period>& tTimeout)
+		{
+			return wait_until(std::chrono::steady_clock::now() + tTimeout);
+		}
+
+	protected:
+		// Spin on the queue for a while before going to sleep. Same adaptive scheme as
+		// tsqueue: spin longer when it pays off, shorter when it doesn't
+		bool spin()
+		{
+			int nBudget = m_nSpinBudget;
+			for (int i = 0; i < nBudget; i++)
+			{
+				if (!empty())
+				{
+					m_nSpinBudget = std::min(nBudget * 2 + 16, nMaxSpin);
+					return true;
+				}
+				cpu_relax();
+			}
+
+			m_nSpinBudget = nBudget / 2;
+			return !empty();
+		}
+
+		struct node
+		{
+			node() = default;
+
+			template<typename... Args>
+			node(Args&&... args) : item(std::forward<Args>(args)...) {}
+
+			std::atomic<node*> next = nullptr;
+			std::optional<T> item;
+		};
+
+		// Nodes come from the buffer pool rather than the heap, so pushing a message
+		// costs no allocation once traffic settles. The consumer frees what producers
+		// allocated, which the pool handles fine
+		template<typename... Args>
+		static node* NewNode(Args&&... args)
+		{
+			void* p = buffer_pool::Get().Allocate(sizeof(node));
+			return new (p) node(std::forward<Args>(args)...);
+		}
+
+		static void DeleteNode(node* pNode)
+		{
+			pNode->~node();
+			buffer_pool::Get().Deallocate(pNode, sizeof(node));
+		}
+
+		void push(node* pNode)
+		{
+			// Claim the back of the queue, then link the old back to it. In between, the
+			// consumer just sees the queue stop at the old back
+			node* pPrev = m_pHead.exchange(pNode, std::memory_order_acq_rel);
+			m_nPushed.fetch_add(1, std::memory_order_relaxed);
+
+			// Only bother with the mutex if the consumer has gone to sleep. Being seq_cst,
+			// this and the consumer's fence make sure either we see the sleeper, or the
+			// sleeper sees our item
+			pPrev->next.exchange(pNode, std::memory_order_seq_cst);
+			if (m_nSleepers.load(std::memory_order_seq_cst) > 0)
+			{
+				std::unique_lock<std::mutex> ul(muxBlocking);
+				cvBlocking.notify_one();
+			}
+		}
+
+	protected:
+		// How many times the next wait checks the queue before going to sleep. Only
+		// the consumer waits, so this needs no protection
+		static constexpr int nMaxSpin = 4096;
+		int m_nSpinBudget = 256;
+
+		// Producers push at the head, the consumer pops from the tail. Kept on separate
+		// cache lines so the two sides don't slow each other down
+		alignas(64) std::atomic<node*> m_pHead;
+		std::atomic<size_t> m_nPushed = 0;
+		alignas(64) node* m_pTail;
+		std::atomic<size_t> m_nPopped = 0;
+
+		// Only used when the consumer has nothing to do and goes to sleep
+		alignas(64) std::atomic<int> m_nSleepers = 0;
+		std::condition_variable cvBlocking;
+		std::mutex muxBlocking;
+	};
+}
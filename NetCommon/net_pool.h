@@ -0,0 +1,556 @@
+#pragma once
+
+#include "net_common.h"
+#include <cstring>
+
+// Pool of reusable memory blocks for message bodies
+
+namespace net
+{
+	// Hands out blocks in power of two size classes, and keeps freed blocks to hand
+	// out again instead of returning them to the heap. Each thread keeps a small
+	// cache of blocks per size class, so most allocations and frees touch no lock at
+	// all. Caches swap blocks with the shared lists in batches when they run dry or
+	// overflow, which is what lets a block allocated on an io thread be freed on the
+	// Update() thread. Once traffic settles, nothing goes to the heap anymore. The
+	// shared lists only hold so much, past that freed blocks go back to the heap, so
+	// memory doesn't stay at whatever a burst of traffic took it to. How much is
+	// scaled to how many blocks are in use, so traffic that swings up and down
+	// within its usual range keeps reusing the same blocks
+	class buffer_pool
+	{
+	public:
+		// Smallest and largest blocks the pool deals in. Anything bigger comes
+		// straight from the heap
+		static constexpr size_t nMinBlockSize = 64;
+		static constexpr size_t nMaxBlockSize = 64 * 1024;
+		static constexpr size_t nSizeClasses = 11;
+
+		// How many blocks of each size a thread holds on to, and how many it swaps
+		// with the shared lists at a time
+		static constexpr size_t nCacheBlocks = 64;
+		static constexpr size_t nBatchBlocks = nCacheBlocks / 2;
+
+		// Roughly how many bytes of free blocks each shared list keeps at least, never
+		// fewer than a few batches' worth. It keeps more while more are in use
+		static constexpr size_t nSharedBytes = 16 * 1024 * 1024;
+
+		struct stats
+		{
+			// Blocks that had to be allocated from the heap
+			size_t nHeapAllocations = 0;
+			// Allocations too big for the pool, these go to the heap every time
+			size_t nOversizeAllocations = 0;
+			// Freed blocks given back to the heap, the shared lists being full
+			size_t nHeapFrees = 0;
+		};
+
+	public:
+		// Don't allow to be copied
+		buffer_pool(const buffer_pool&) = delete;
+
+		virtual ~buffer_pool()
+		{
+			for (auto& list : m_vShared)
+			{
+				while (list.pHead)
+				{
+					block* pNext = list.pHead->pNext;
+					::operator delete(list.pHead);
+					list.pHead = pNext;
+				}
+			}
+		}
+
+		// The pool shared by the whole process. Never destroyed, so buffers freed by
+		// the destructors of other statics still have somewhere to go
+		static buffer_pool& Get()
+		{
+			static buffer_pool* pPool = new buffer_pool();
+			return *pPool;
+		}
+
+	public:
+		void* Allocate(size_t nBytes)
+		{
+			if (nBytes > nMaxBlockSize)
+			{
+				m_nOversizeAllocations.fetch_add(1, std::memory_order_relaxed);
+				return ::operator new(nBytes);
+			}
+
+			size_t nClass = SizeClass(nBytes);
+			thread_cache* pCache = Cache();
+			if (pCache)
+			{
+				thread_cache::list& cache = pCache->vLists[nClass];
+
+				// Out of blocks of this size, so top up from the shared list
+				if (!cache.pHead)
+				{
+					Refill(nClass, cache);
+				}
+
+				if (cache.pHead)
+				{
+					block* pBlock = cache.pHead;
+					cache.pHead = pBlock->pNext;
+					cache.nCount--;
+					return pBlock;
+				}
+			}
+			else if (block* pBlock = TakeShared(nClass))
+			{
+				// This thread's cache is gone, it's exiting
+				return pBlock;
+			}
+
+			// Nothing to reuse anywhere, this is a genuinely new block
+			m_nHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+			m_vShared[nClass].nAllocated.fetch_add(1, std::memory_order_relaxed);
+			return ::operator new(nMinBlockSize << nClass);
+		}
+
+		void Deallocate(void* p, size_t nBytes)
+		{
+			if (nBytes > nMaxBlockSize)
+			{
+				::operator delete(p);
+				return;
+			}
+
+			size_t nClass = SizeClass(nBytes);
+			block* pBlock = static_cast<block*>(p);
+			thread_cache* pCache = Cache();
+			if (!pCache)
+			{
+				// Freed while the thread is exiting, after its cache went
+				thread_cache::list single;
+				single.pHead = pBlock;
+				single.nCount = 1;
+				pBlock->pNext = nullptr;
+				Release(nClass, single, 1);
+				return;
+			}
+
+			thread_cache::list& cache = pCache->vLists[nClass];
+			pBlock->pNext = cache.pHead;
+			cache.pHead = pBlock;
+			cache.nCount++;
+
+			// Holding too many, give some back so other threads can use them
+			if (cache.nCount > nCacheBlocks)
+			{
+				Release(nClass, cache, nBatchBlocks);
+			}
+		}
+
+		// Size of the block actually handed out for an allocation of nBytes. Anything
+		// up to this size fits, so callers might as well use it all
+		static size_t BlockSize(size_t nBytes)
+		{
+			return nBytes > nMaxBlockSize ? nBytes : nMinBlockSize << SizeClass(nBytes);
+		}
+
+		stats GetStats() const
+		{
+			stats s;
+			s.nHeapAllocations = m_nHeapAllocations.load(std::memory_order_relaxed);
+			s.nOversizeAllocations = m_nOversizeAllocations.load(std::memory_order_relaxed);
+			s.nHeapFrees = m_nHeapFrees.load(std::memory_order_relaxed);
+			return s;
+		}
+
+	protected:
+		// There is only ever the one pool, see Get(). Thread caches belong to it
+		buffer_pool() = default;
+
+		// A free block doubles as a node in a list of free blocks
+		struct block
+		{
+			block* pNext;
+		};
+
+		struct shared_list
+		{
+			std::mutex mux;
+			block* pHead = nullptr;
+			size_t nCount = 0;
+
+			// Blocks of this size taken from the heap and not yet given back, wherever
+			// they are now
+			std::atomic<size_t> nAllocated = 0;
+		};
+
+		// Each thread's own stock of blocks. When the thread ends, everything it held
+		// goes back to the shared lists
+		struct thread_cache
+		{
+			struct list
+			{
+				block* pHead = nullptr;
+				size_t nCount = 0;
+			};
+
+			thread_cache(buffer_pool* pPool, bool& bDestroyed)
+				: m_pPool(pPool), m_bDestroyed(bDestroyed)
+			{}
+
+			~thread_cache()
+			{
+				for (size_t i = 0; i < nSizeClasses; i++)
+				{
+					m_pPool->Release(i, vLists[i], vLists[i].nCount);
+				}
+				m_bDestroyed = true;
+			}
+
+			list vLists[nSizeClasses];
+
+		private:
+			buffer_pool* m_pPool;
+			bool& m_bDestroyed;
+		};
+
+		// The calling thread's cache, or nullptr once it has been destroyed. Other
+		// thread_locals can still free buffers after that, as the thread exits
+		thread_cache* Cache()
+		{
+			// Plain bool, so it's still there after the cache has gone
+			static thread_local bool bDestroyed = false;
+			if (bDestroyed)
+			{
+				return nullptr;
+			}
+
+			static thread_local thread_cache cache(this, bDestroyed);
+			return &cache;
+		}
+
+		// Which size class holds blocks of at least nBytes
+		static size_t SizeClass(size_t nBytes)
+		{
+			size_t nClass = 0;
+			while ((nMinBlockSize << nClass) < nBytes)
+			{
+				nClass++;
+			}
+			return nClass;
+		}
+
+		// How many free blocks of a size class the shared list holds on to, at least
+		static constexpr size_t SharedLimit(size_t nClass)
+		{
+			return std::max(nBatchBlocks * 4, nSharedBytes / (nMinBlockSize << nClass));
+		}
+
+		// Move a batch of blocks from the shared list into a thread's cache
+		void Refill(size_t nClass, thread_cache::list& cache)
+		{
+			shared_list& shared = m_vShared[nClass];
+			std::scoped_lock lock(shared.mux);
+			while (shared.pHead && cache.nCount < nBatchBlocks)
+			{
+				block* pBlock = shared.pHead;
+				shared.pHead = pBlock->pNext;
+				shared.nCount--;
+				pBlock->pNext = cache.pHead;
+				cache.pHead = pBlock;
+				cache.nCount++;
+			}
+		}
+
+		// One block from the shared list, if it has any
+		block* TakeShared(size_t nClass)
+		{
+			shared_list& shared = m_vShared[nClass];
+			std::scoped_lock lock(shared.mux);
+			block* pBlock = shared.pHead;
+			if (pBlock)
+			{
+				shared.pHead = pBlock->pNext;
+				shared.nCount--;
+			}
+			return pBlock;
+		}
+
+		// Move nBlocks from a thread's cache onto the shared list. Whatever doesn't
+		// fit goes back to the heap. The list keeps up to as many free blocks as are
+		// in use elsewhere, so a queue that fills and drains over and over doesn't
+		// send half its blocks back to the heap each time it drains
+		void Release(size_t nClass, thread_cache::list& cache, size_t nBlocks)
+		{
+			shared_list& shared = m_vShared[nClass];
+			block* pSpare = nullptr;
+			size_t nSpare = 0;
+			{
+				std::scoped_lock lock(shared.mux);
+				while (cache.pHead && nBlocks > 0)
+				{
+					block* pBlock = cache.pHead;
+					cache.pHead = pBlock->pNext;
+					cache.nCount--;
+					nBlocks--;
+
+					size_t nTotal = shared.nAllocated.load(std::memory_order_relaxed) - nSpare;
+					size_t nInUse = nTotal > shared.nCount ? nTotal - shared.nCount : 0;
+					if (shared.nCount < std::max(SharedLimit(nClass), nInUse))
+					{
+						pBlock->pNext = shared.pHead;
+						shared.pHead = pBlock;
+						shared.nCount++;
+					}
+					else
+					{
+						pBlock->pNext = pSpare;
+						pSpare = pBlock;
+						nSpare++;
+					}
+				}
+			}
+
+			// Freed outside the lock
+			shared.nAllocated.fetch_sub(nSpare, std::memory_order_relaxed);
+			while (pSpare)
+			{
+				block* pNext = pSpare->pNext;
+				::operator delete(pSpare);
+				m_nHeapFrees.fetch_add(1, std::memory_order_relaxed);
+				pSpare = pNext;
+			}
+		}
+
+	protected:
+		shared_list m_vShared[nSizeClasses];
+
+		std::atomic<size_t> m_nHeapAllocations = 0;
+		std::atomic<size_t> m_nOversizeAllocations = 0;
+		std::atomic<size_t> m_nHeapFrees = 0;
+	};
+
+	// Standard allocator that draws from the buffer pool, so containers can use it
+	template<typename U>
+	struct pool_allocator
+	{
+		using value_type = U;
+
+		pool_allocator() = default;
+
+		template<typename V>
+		pool_allocator(const pool_allocator<V>&)
+		{}
+
+		U* allocate(size_t n)
+		{
+			return static_cast<U*>(buffer_pool::Get().Allocate(n * sizeof(U)));
+		}
+
+		void deallocate(U* p, size_t n)
+		{
+			buffer_pool::Get().Deallocate(p, n * sizeof(U));
+		}
+
+		template<typename V>
+		bool operator == (const pool_allocator<V>&) const { return true; }
+
+		template<typename V>
+		bool operator != (const pool_allocator<V>&) const { return false; }
+	};
+
+	// Wraps a completion handler so asio allocates the operation holding it from the
+	// buffer pool. asio's own recycling only reuses memory freed on the thread that
+	// allocated it, which isn't the case when another thread posts to an io thread
+	template<typename Handler>
+	class pooled_handler
+	{
+	public:
+		using allocator_type = pool_allocator<uint8_t>;
+
+		explicit pooled_handler(Handler handler) : m_handler(std::move(handler))
+		{}
+
+		allocator_type get_allocator() const noexcept
+		{
+			return allocator_type();
+		}
+
+		template<typename... Args>
+		void operator()(Args&&... args)
+		{
+			m_handler(std::forward<Args>(args)...);
+		}
+
+	protected:
+		Handler m_handler;
+	};
+
+	template<typename Handler>
+	pooled_handler<std::decay_t<Handler>> make_pooled_handler(Handler&& handler)
+	{
+		return pooled_handler<std::decay_t<Handler>>(std::forward<Handler>(handler));
+	}
+
+	// Growable array of bytes, much like a std::vector<uint8_t>, whose memory comes
+	// from the buffer pool. Not a vector with a pool_allocator, as vectors only use
+	// memcpy/memset for the standard allocator and fall back to copying byte by byte
+	class pooled_buffer
+	{
+	public:
+		pooled_buffer() = default;
+
+		pooled_buffer(const pooled_buffer& other)
+		{
+			assign(other.begin(), other.end());
+		}
+
+		pooled_buffer(pooled_buffer&& other) noexcept
+			: m_pData(other.m_pData), m_nSize(other.m_nSize), m_nCapacity(other.m_nCapacity)
+		{
+			other.m_pData = nullptr;
+			other.m_nSize = 0;
+			other.m_nCapacity = 0;
+		}
+
+		pooled_buffer& operator = (const pooled_buffer& other)
+		{
+			if (this != &other)
+			{
+				assign(other.begin(), other.end());
+			}
+			return *this;
+		}
+
+		pooled_buffer& operator = (pooled_buffer&& other) noexcept
+		{
+			if (this != &other)
+			{
+				Release();
+				std::swap(m_pData, other.m_pData);
+				std::swap(m_nSize, other.m_nSize);
+				std::swap(m_nCapacity, other.m_nCapacity);
+			}
+			return *this;
+		}
+
+		~pooled_buffer()
+		{
+			Release();
+		}
+
+	public:
+		uint8_t* data() { return m_pData; }
+		const uint8_t* data() const { return m_pData; }
+
+		uint8_t* begin() { return m_pData; }
+		const uint8_t* begin() const { return m_pData; }
+		uint8_t* end() { return m_pData + m_nSize; }
+		const uint8_t* end() const { return m_pData + m_nSize; }
+
+		uint8_t& operator [] (size_t i) { return m_pData[i]; }
+		const uint8_t& operator [] (size_t i) const { return m_pData[i]; }
+
+		size_t size() const { return m_nSize; }
+		size_t capacity() const { return m_nCapacity; }
+		bool empty() const { return m_nSize == 0; }
+
+		// Make sure there is room for at least nCapacity bytes without growing again
+		void reserve(size_t nCapacity)
+		{
+			if (nCapacity > m_nCapacity)
+			{
+				Reallocate(nCapacity);
+			}
+		}
+
+		// Change the size. New bytes are set to nValue, zero unless told otherwise
+		void resize(size_t nSize, uint8_t nValue = 0)
+		{
+			if (nSize > m_nSize)
+			{
+				if (nSize > m_nCapacity)
+				{
+					// Grow geometrically, so a body built up a field at a time only
+					// reallocates a handful of times
+					Reallocate(std::max(nSize, m_nCapacity * 2));
+				}
+				std::memset(m_pData + m_nSize, nValue, nSize - m_nSize);
+			}
+			m_nSize = nSize;
+		}
+
+		void push_back(uint8_t nValue)
+		{
+			resize(m_nSize + 1, nValue);
+		}
+
+		// Copy nBytes onto the end, growing if need be
+		void append(const void* pData, size_t nBytes)
+		{
+			if (m_nSize + nBytes > m_nCapacity)
+			{
+				Reallocate(std::max(m_nSize + nBytes, m_nCapacity * 2));
+			}
+			if (nBytes > 0)
+			{
+				std::memcpy(m_pData + m_nSize, pData, nBytes);
+			}
+			m_nSize += nBytes;
+		}
+
+		// Replace the contents with a copy of [pFirst, pLast)
+		void assign(const uint8_t* pFirst, const uint8_t* pLast)
+		{
+			size_t nSize = size_t(pLast - pFirst);
+			if (nSize > m_nCapacity)
+			{
+				// Old contents are being replaced, so no point copying them over
+				Release();
+				Reallocate(nSize);
+			}
+			if (nSize > 0)
+			{
+				std::memcpy(m_pData, pFirst, nSize);
+			}
+			m_nSize = nSize;
+		}
+
+		// Empty, but keep the memory for reuse
+		void clear()
+		{
+			m_nSize = 0;
+		}
+
+	private:
+		void Reallocate(size_t nCapacity)
+		{
+			nCapacity = buffer_pool::BlockSize(nCapacity);
+			uint8_t* pData = static_cast<uint8_t*>(buffer_pool::Get().Allocate(nCapacity));
+			if (m_nSize > 0)
+			{
+				std::memcpy(pData, m_pData, m_nSize);
+			}
+			size_t nSize = m_nSize;
+			Release();
+			m_pData = pData;
+			m_nSize = nSize;
+			m_nCapacity = nCapacity;
+		}
+
+		// Hand the memory back to the pool
+		void Release()
+		{
+			if (m_pData)
+			{
+				buffer_pool::Get().Deallocate(m_pData, m_nCapacity);
+			}
+			m_pData = nullptr;
+			m_nSize = 0;
+			m_nCapacity = 0;
+		}
+
+	private:
+		uint8_t* m_pData = nullptr;
+		size_t m_nSize = 0;
+		size_t m_nCapacity = 0;
+	};
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "net_common.h"
+
+// Container that hands out an ID for everything put in it
+
+namespace net
+{
+	// Stores values by a 32 bit ID, with insert, lookup and removal all O(1). The
+	// low bits of an ID pick a slot, the high bits are that slot's generation,
+	// which goes up each time the slot is reused. An ID left over from something
+	// removed therefore finds nothing, rather than whatever took its slot. Values
+	// themselves are kept packed together, so going through all of them is as
+	// quick as going through a vector (because it is one). Removing swaps the last
+	// value into the gap, so it changes the order
+	template<typename V>
+	class slot_map
+	{
+	public:
+		static constexpr uint32_t nSlotBits = 20;
+		static constexpr uint32_t nMaxSlots = 1u << nSlotBits;
+		static constexpr uint32_t nSlotMask = nMaxSlots - 1;
+		static constexpr uint32_t nGenerationMask = (1u << (32 - nSlotBits)) - 1;
+
+		// Never handed out
+		static constexpr uint32_t nInvalidID = 0;
+
+	public:
+		// Add a value, returning its ID. Returns nInvalidID if all slots are in use
+		uint32_t Insert(V value)
+		{
+			uint32_t nSlot;
+			if (!m_qFreeSlots.empty())
+			{
+				// Reuse the slot that has been free longest, so generations wrap slowly
+				nSlot = m_qFreeSlots.front();
+				m_qFreeSlots.pop_front();
+			}
+			else if (m_vSlots.size() < nMaxSlots)
+			{
+				nSlot = uint32_t(m_vSlots.size());
+				m_vSlots.push_back({ 1, nFreeIndex });
+			}
+			else
+			{
+				return nInvalidID;
+			}
+
+			slot& s = m_vSlots[nSlot];
+			s.nIndex = uint32_t(m_vValues.size());
+			m_vValues.push_back(std::move(value));
+			m_vSlotOfValue.push_back(nSlot);
+			return (s.nGeneration << nSlotBits) | nSlot;
+		}
+
+		// The value with this ID, or nullptr if there isn't one
+		V* Find(uint32_t nID)
+		{
+			slot* s = Lookup(nID);
+			return s ? &m_vValues[s->nIndex] : nullptr;
+		}
+
+		const V* Find(uint32_t nID) const
+		{
+			return const_cast<slot_map*>(this)->Find(nID);
+		}
+
+		// Remove the value with this ID. Returns false if there wasn't one
+		bool Remove(uint32_t nID)
+		{
+			slot* s = Lookup(nID);
+			if (!s)
+			{
+				return false;
+			}
+
+			// Fill the gap with the last value
+			uint32_t nIndex = s->nIndex;
+			uint32_t nLast = uint32_t(m_vValues.size() - 1);
+			if (nIndex != nLast)
+			{
+				m_vValues[nIndex] = std::move(m_vValues[nLast]);
+				m_vSlotOfValue[nIndex] = m_vSlotOfValue[nLast];
+				m_vSlots[m_vSlotOfValue[nIndex]].nIndex = nIndex;
+			}
+			m_vValues.pop_back();
+			m_vSlotOfValue.pop_back();
+			s->nIndex = nFreeIndex;
+
+			// Retire the ID. Generation 0 is skipped so no ID is ever nInvalidID
+			s->nGeneration = (s->nGeneration + 1) & nGenerationMask;
+			if (s->nGeneration == 0)
+			{
+				s->nGeneration = 1;
+			}
+			m_qFreeSlots.push_back(nID & nSlotMask);
+			return true;
+		}
+
+		size_t size() const { return m_vValues.size(); }
+		bool empty() const { return m_vValues.empty(); }
+
+		// All of the values, packed together in no particular order
+		typename std::vector<V>::iterator begin() { return m_vValues.begin(); }
+		typename std::vector<V>::iterator end() { return m_vValues.end(); }
+		typename std::vector<V>::const_iterator begin() const { return m_vValues.begin(); }
+		typename std::vector<V>::const_iterator end() const { return m_vValues.end(); }
+
+		void clear()
+		{
+			m_vSlots.clear();
+			m_qFreeSlots.clear();
+			m_vValues.clear();
+			m_vSlotOfValue.clear();
+		}
+
+	private:
+		// A slot's nIndex while it has no value
+		static constexpr uint32_t nFreeIndex = ~0u;
+
+		struct slot
+		{
+			uint32_t nGeneration;
+			// Where the slot's value is in m_vValues, or nFreeIndex if it has none
+			uint32_t nIndex;
+		};
+
+		slot* Lookup(uint32_t nID)
+		{
+			uint32_t nSlot = nID & nSlotMask;
+			if (nSlot >= m_vSlots.size())
+			{
+				return nullptr;
+			}
+
+			// A free slot's generation has already moved on, but an ID can still be made
+			// up to match it, so check the slot really has a value
+			slot& s = m_vSlots[nSlot];
+			if (s.nIndex == nFreeIndex || s.nGeneration != (nID >> nSlotBits))
+			{
+				return nullptr;
+			}
+			return &s;
+		}
+
+	private:
+		std::vector<slot> m_vSlots;
+		std::deque<uint32_t> m_qFreeSlots;
+
+		// The values, and which slot each belongs to
+		std::vector<V> m_vValues;
+		std::vector<uint32_t> m_vSlotOfValue;
+	};
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "net_common.h"
+#include "net_message.h"
+#include "net_connection.h"
+#include "net_serializer.h"
+#include "net_view.h"
+
+#include <array>
+#include <functional>
+
+// Routes messages to a handler per message ID, decided at compile time
+
+namespace net
+{
+	// One entry in a message_router. Messages with ID Id have their body read into a
+	// Payload (with message_reader), which is then handed to Handler. Handler is a
+	// member function of the router's owner, void (Owner::*)(std::shared_ptr<connection<T>>, Payload&),
+	// or a free function that takes the owner first. A Payload of message<T> is
+	// handed over as is, for handlers that want to deal with the message themselves,
+	// and a message_view is pointed at the body rather than reading anything out
+	template<auto Id, typename Payload, auto Handler>
+	struct route
+	{
+		static constexpr auto id = Id;
+		using payload = Payload;
+		static constexpr auto handler = Handler;
+	};
+
+	// Looks a message's handler up in a table indexed by message ID, built at compile
+	// time from the routes. Instead of a switch in OnMessage:
+	//
+	//	using router = net::message_router<MsgTypes, MyServer,
+	//		net::route<MsgTypes::Chat, chat_message, &MyServer::OnChat>,
+	//		net::route<MsgTypes::Ping, net::message<MsgTypes>, &MyServer::OnPing>>;
+	//
+	//	SetHeaderFilter(router::Accepts);		// IDs with no route never get past the socket
+	//	router::Dispatch(*this, client, msg);	// in OnMessage
+	//
+	// IDs are used as indices, so they should be small and not too spread out
+	template<typename T, typename Owner, typename... Routes>
+	class message_router
+	{
+	public:
+		static_assert(sizeof...(Routes) > 0, "A router needs at least one route");
+		static_assert((std::is_same<std::remove_const_t<decltype(Routes::id)>, T>::value && ...),
+			"Route IDs must be of the router's message ID type");
+
+		// One more than the largest routed ID
+		static constexpr size_t nTableSize = std::max({ size_t(Routes::id)... }) + 1;
+
+		static_assert([]()
+			{
+				size_t vIDs[] = { size_t(Routes::id)... };
+				for (size_t i = 0; i < sizeof...(Routes); i++)
+				{
+					for (size_t j = i + 1; j < sizeof...(Routes); j++)
+					{
+						if (vIDs[i] == vIDs[j])
+						{
+							return false;
+						}
+					}
+				}
+				return true;
+			}(), "Two routes have the same ID");
+
+	public:
+		// Hand a message to its handler. Returns false if there is no route for its ID,
+		// or its body couldn't be read as the route's payload
+		static bool Dispatch(Owner& owner, std::shared_ptr<connection<T>> client, message<T>& msg)
+		{
+			size_t nIndex = size_t(msg.header.id);
+			if (nIndex >= nTableSize || !vTable[nIndex])
+			{
+				return false;
+			}
+			return vTable[nIndex](owner, client, msg);
+		}
+
+		// True if there is a route for the header's ID. Fits SetHeaderFilter(), so
+		// messages nobody handles are thrown away before they are even read in
+		static bool Accepts(const message_header<T>& header)
+		{
+			size_t nIndex = size_t(header.id);
+			return nIndex < nTableSize && vTable[nIndex] != nullptr;
+		}
+
+	private:
+		using handler_fn = bool(*)(Owner&, std::shared_ptr<connection<T>>&, message<T>&);
+
+		// Reads the payload, if there is one, and calls the route's handler
+		template<typename Route>
+		static bool Invoke(Owner& owner, std::shared_ptr<connection<T>>& client, message<T>& msg)
+		{
+			if constexpr (std::is_same<typename Route::payload, message<T>>::value)
+			{
+				std::invoke(Route::handler, owner, client, msg);
+			}
+			else if constexpr (is_message_view<typename Route::payload>::value)
+			{
+				typename Route::payload view(msg);
+				if (!view.valid())
+				{
+					return false;
+				}
+				std::invoke(Route::handler, owner, client, view);
+			}
+			else
+			{
+				typename Route::payload payload{};
+				message_reader<T> reader(msg);
+				reader >> payload;
+				if (!reader)
+				{
+					return false;
+				}
+				std::invoke(Route::handler, owner, client, payload);
+			}
+			return true;
+		}
+
+		// Empty slots are IDs with no route
+		static constexpr std::array<handler_fn, nTableSize> vTable = []()
+			{
+				std::array<handler_fn, nTableSize> vTable{};
+				((vTable[size_t(Routes::id)] = &Invoke<Routes>), ...);
+				return vTable;
+			}();
+	};
+}
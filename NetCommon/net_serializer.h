@@ -0,0 +1,315 @@
+#pragma once
+
+#include "net_common.h"
+#include "net_message.h"
+
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Streaming serialization for message bodies. Unlike message<T>'s own operators,
+// fields are read back in the same order they were written, and strings, vectors
+// and anything else with its own operators can be written as well as plain data
+
+namespace net
+{
+	// Wraps an integer so it is written as a varint: 7 bits per byte, small values
+	// taking fewer bytes. Signed values are zigzag encoded so small negatives stay small
+	template<typename U>
+	struct varint_ref
+	{
+		static_assert(std::is_integral<std::remove_const_t<U>>::value, "Only integers can be written as varints");
+		U& value;
+	};
+
+	template<typename U>
+	varint_ref<U> varint(U& value)
+	{
+		return { value };
+	}
+
+	// Writes fields one after another onto the end of a message's body
+	template<typename T>
+	class message_writer
+	{
+	public:
+		// nReserve bytes are set aside up front. When a body's final size is known (or
+		// can be guessed), this means it is written without growing once
+		message_writer(message<T>& msg, size_t nReserve = 0) : m_msg(msg)
+		{
+			m_msg.body.reserve(m_msg.body.size() + nReserve);
+		}
+
+	public:
+		// Copy raw bytes onto the end of the body
+		message_writer& Write(const void* pData, size_t nBytes)
+		{
+			m_msg.body.append(pData, nBytes);
+			m_msg.header.size = uint32_t(m_msg.body.size());
+			return *this;
+		}
+
+		// Write an unsigned integer as a varint
+		message_writer& WriteVarint(uint64_t nValue)
+		{
+			uint8_t vBytes[10];
+			size_t nBytes = 0;
+			while (nValue >= 0x80)
+			{
+				vBytes[nBytes++] = uint8_t(nValue) | 0x80;
+				nValue >>= 7;
+			}
+			vBytes[nBytes++] = uint8_t(nValue);
+			return Write(vBytes, nBytes);
+		}
+
+		// Bytes written to the body so far
+		size_t size() const
+		{
+			return m_msg.body.size();
+		}
+
+		// Plain data, copied as is
+		template<typename DataType>
+		friend std::enable_if_t<std::is_trivially_copyable<DataType>::value, message_writer&>
+			operator << (message_writer& writer, const DataType& data)
+		{
+			return writer.Write(&data, sizeof(DataType));
+		}
+
+		template<typename U>
+		friend message_writer& operator << (message_writer& writer, varint_ref<U> v)
+		{
+			if constexpr (std::is_signed<std::remove_const_t<U>>::value)
+			{
+				int64_t n = int64_t(v.value);
+				return writer.WriteVarint((uint64_t(n) << 1) ^ uint64_t(n >> 63));
+			}
+			else
+			{
+				return writer.WriteVarint(uint64_t(v.value));
+			}
+		}
+
+		// Strings are written as their length followed by their characters
+		friend message_writer& operator << (message_writer& writer, std::string_view s)
+		{
+			writer.WriteVarint(s.size());
+			return writer.Write(s.data(), s.size());
+		}
+
+		friend message_writer& operator << (message_writer& writer, const std::string& s)
+		{
+			return writer << std::string_view(s);
+		}
+
+		friend message_writer& operator << (message_writer& writer, const char* s)
+		{
+			return writer << std::string_view(s);
+		}
+
+		// Vectors are written as their length followed by their elements. Elements that
+		// are plain data all go in one copy
+		template<typename U, typename Alloc>
+		friend message_writer& operator << (message_writer& writer, const std::vector<U, Alloc>& v)
+		{
+			writer.WriteVarint(v.size());
+			if constexpr (std::is_trivially_copyable<U>::value)
+			{
+				return writer.Write(v.data(), v.size() * sizeof(U));
+			}
+			else
+			{
+				for (const auto& item : v)
+				{
+					writer << item;
+				}
+				return writer;
+			}
+		}
+
+	private:
+		message<T>& m_msg;
+	};
+
+	// Reads fields, in the order they were written, from the front of a body. The
+	// body is never modified. Reading past the end doesn't go anywhere it shouldn't:
+	// the reader marks itself as failed and every read from then on gives zeroes,
+	// so a whole set of fields can be read and checked once at the end
+	template<typename T>
+	class message_reader
+	{
+	public:
+		message_reader(const message<T>& msg)
+			: m_pData(msg.body.data()), m_nSize(msg.body.size())
+		{}
+
+		// Read from any block of bytes, such as one still in a receive buffer
+		message_reader(const uint8_t* pData, size_t nSize)
+			: m_pData(pData), m_nSize(nSize)
+		{}
+
+	public:
+		// Copy raw bytes out of the body
+		bool Read(void* pData, size_t nBytes)
+		{
+			if (nBytes == 0)
+			{
+				return !m_bFailed;
+			}
+
+			if (m_bFailed || nBytes > remaining())
+			{
+				Fail();
+				std::memset(pData, 0, nBytes);
+				return false;
+			}
+
+			std::memcpy(pData, m_pData + m_nCursor, nBytes);
+			m_nCursor += nBytes;
+			return true;
+		}
+
+		// Read a varint as an unsigned integer
+		uint64_t ReadVarint()
+		{
+			uint64_t nValue = 0;
+			for (int nShift = 0; nShift < 64; nShift += 7)
+			{
+				uint8_t nByte = 0;
+				if (!Read(&nByte, 1))
+				{
+					return 0;
+				}
+
+				nValue |= uint64_t(nByte & 0x7F) << nShift;
+				if (!(nByte & 0x80))
+				{
+					return nValue;
+				}
+			}
+
+			// Too long to be a valid varint
+			Fail();
+			return 0;
+		}
+
+		// Read a length written before a string or vector. A length that couldn't
+		// possibly fit in what's left fails straight away, before anything is allocated
+		size_t ReadLength(size_t nElementSize)
+		{
+			uint64_t nLength = ReadVarint();
+			if (nElementSize > 0 && nLength > remaining() / nElementSize)
+			{
+				Fail();
+				return 0;
+			}
+			return size_t(nLength);
+		}
+
+		// Move past nBytes without reading them
+		bool Skip(size_t nBytes)
+		{
+			if (m_bFailed || nBytes > remaining())
+			{
+				Fail();
+				return false;
+			}
+			m_nCursor += nBytes;
+			return true;
+		}
+
+		// Bytes left to be read
+		size_t remaining() const
+		{
+			return m_bFailed ? 0 : m_nSize - m_nCursor;
+		}
+
+		// Where the next read comes from
+		const uint8_t* data() const
+		{
+			return m_pData + m_nCursor;
+		}
+
+		// True as long as no read has gone past the end
+		bool ok() const
+		{
+			return !m_bFailed;
+		}
+
+		explicit operator bool() const
+		{
+			return ok();
+		}
+
+		// Mark the reader as failed, for custom operators that find bad data
+		void Fail()
+		{
+			m_bFailed = true;
+		}
+
+		// Plain data, copied as is
+		template<typename DataType>
+		friend std::enable_if_t<std::is_trivially_copyable<DataType>::value, message_reader&>
+			operator >> (message_reader& reader, DataType& data)
+		{
+			reader.Read(&data, sizeof(DataType));
+			return reader;
+		}
+
+		template<typename U>
+		friend message_reader& operator >> (message_reader& reader, varint_ref<U> v)
+		{
+			static_assert(!std::is_const<U>::value, "Can't read into a const");
+
+			uint64_t n = reader.ReadVarint();
+			if constexpr (std::is_signed<U>::value)
+			{
+				v.value = U(int64_t(n >> 1) ^ -int64_t(n & 1));
+			}
+			else
+			{
+				v.value = U(n);
+			}
+			return reader;
+		}
+
+		friend message_reader& operator >> (message_reader& reader, std::string& s)
+		{
+			size_t nLength = reader.ReadLength(1);
+			s.assign(reinterpret_cast<const char*>(reader.data()), reader.ok() ? nLength : 0);
+			reader.Skip(nLength);
+			return reader;
+		}
+
+		template<typename U, typename Alloc>
+		friend message_reader& operator >> (message_reader& reader, std::vector<U, Alloc>& v)
+		{
+			if constexpr (std::is_trivially_copyable<U>::value)
+			{
+				size_t nLength = reader.ReadLength(sizeof(U));
+				v.resize(nLength);
+				reader.Read(v.data(), nLength * sizeof(U));
+			}
+			else
+			{
+				// Every element takes at least a byte, which is enough to catch silly lengths
+				size_t nLength = reader.ReadLength(1);
+				v.clear();
+				v.reserve(nLength);
+				for (size_t i = 0; i < nLength && reader.ok(); i++)
+				{
+					v.emplace_back();
+					reader >> v.back();
+				}
+			}
+			return reader;
+		}
+
+	private:
+		const uint8_t* m_pData = nullptr;
+		size_t m_nSize = 0;
+		size_t m_nCursor = 0;
+		bool m_bFailed = false;
+	};
+}
@@ -4,6 +4,10 @@
 #include "net_tsqueue.h"
 #include "net_message.h"
 #include "net_connection.h"
+#include "net_iopool.h"
+#include "net_registry.h"
+#include "net_metrics.h"
+#include "net_log.h"
 
 namespace net
 {
@@ -11,11 +15,49 @@ namespace net
 	class server_interface
 	{
 	public:
+		// A list of clients, see GetClients()
+		using client_list = std::vector<std::shared_ptr<connection<T>>>;
 
-		server_interface(uint16_t port) 
-			: m_asioAcceptor(m_asioContext, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))
+
+		// nIOThreads is the number of threads doing socket work. Accepted clients are
+		// spread over them, each client sticking to the one thread it was given.
+		// nAcceptors > 1 opens that many acceptors on the same port with SO_REUSEPORT,
+		// each on its own io thread, and lets the kernel spread new connections
+		server_interface(uint16_t port, size_t nIOThreads = 1, size_t nAcceptors = 1)
+			: m_ioPool(nIOThreads)
 		{
-			
+			// Each io thread counts into its own metrics
+			for (size_t i = 0; i < m_ioPool.Size(); i++)
+			{
+				m_vMetrics.push_back(std::make_unique<metrics_shard<T>>());
+			}
+
+			asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
+
+#ifndef SO_REUSEPORT
+			if (nAcceptors > 1)
+			{
+				NET_LOG_WARN("[SERVER] SO_REUSEPORT not supported, using a single acceptor");
+				nAcceptors = 1;
+			}
+#endif
+			nAcceptors = std::max<size_t>(nAcceptors, 1);
+
+			for (size_t i = 0; i < nAcceptors; i++)
+			{
+				asio::ip::tcp::acceptor acceptor(m_ioPool.GetContext(i));
+				acceptor.open(endpoint.protocol());
+				acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+				if (nAcceptors > 1)
+				{
+					acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+				}
+#endif
+				acceptor.bind(endpoint);
+				acceptor.listen();
+				m_vAcceptors.push_back(std::move(acceptor));
+			}
 		}
 
 		virtual ~server_interface()
@@ -29,135 +71,385 @@ namespace net
 			try
 			{
 				// Give the server work to do before starting thread, so that it doesn't return immidietly
-				WaitForClientConnection();
+				for (size_t i = 0; i < m_vAcceptors.size(); i++)
+				{
+					WaitForClientConnection(i);
+				}
 
-				m_threadContext = std::thread([this]() { m_asioContext.run(); });
+				m_ioPool.Start();
 			}
 			catch (std::exception& e)
 			{
 				// Something happened, server can't start
-				std::cerr << "[SERVER] Exception: " << e.what() << "\n";
+				NET_LOG_ERROR("[SERVER] Exception: ", e.what());
 				return false;
 			}
 
-			std::cout << "[SERVER] Started\n";
+			NET_LOG_INFO("[SERVER] Started");
 			return true;
 		}
 
 		// Stop the server
 		void Stop()
 		{
-			// Request the context to close
-			m_asioContext.stop();
+			// Request the contexts to close, and tidy up their threads
+			m_ioPool.Stop();
 
-			// Tidy up context thread
-			if (m_threadContext.joinable())
+			// Inform anybody who's listening
+			NET_LOG_INFO("[SERVER] Stopped");
+
+		}
+
+		// Throw away incoming messages whose header the filter rejects, such as ones
+		// with an ID nothing handles (see message_router::Accepts). Applies to clients
+		// that connect after it is set
+		void SetHeaderFilter(header_filter<T> pfnFilter)
+		{
+			m_pfnHeaderFilter = pfnFilter;
+		}
+
+		// Limits on each client's outgoing queue, and what to do with a client that
+		// reaches them (see queue_limits). Applies to clients that connect after it is set
+		void SetQueueLimits(const queue_limits& limits)
+		{
+			m_queueLimits = limits;
+		}
+
+		// Handshake, idle and stall deadlines for each client, and heartbeats (see
+		// connection_timeouts). Applies to clients that connect after it is set
+		void SetTimeouts(const connection_timeouts<T>& timeouts)
+		{
+			m_timeouts = timeouts;
+		}
+
+		// Choose where OnMessage() is called. Queued, the default, calls it from Update().
+		// inline_io calls it on the io thread that read the message, as soon as it is
+		// read, and Update() has nothing to do. With several io threads, OnMessage() is
+		// then called from all of them at once, so anything it shares needs guarding.
+		// Sending to other clients is already safe. Applies to clients that connect
+		// after it is set
+		void SetDispatchMode(dispatch_mode nMode)
+		{
+			m_nDispatchMode = nMode;
+		}
+
+		// Count each client's traffic by message ID, for its GetMetrics(), as well as
+		// the server's. Off by default, as the counters take 2KB a client with the
+		// default 64 message IDs (see message_type_count). Applies to clients that
+		// connect after it is set
+		void SetConnectionTrafficMetrics(bool bEnabled)
+		{
+			m_bConnectionTraffic = bEnabled;
+		}
+
+		// Answer messages with this ID with the server's metrics, rather than handing
+		// them to OnMessage(). The reply has the same ID, with a metrics_snapshot<T> as
+		// its body, so anything that can connect can watch the server live. Only set it
+		// if every client may see that
+		void SetMetricsMessage(T nID)
+		{
+			m_nMetricsID = nID;
+		}
+
+		// Everything counted by the server since it was made: traffic by message ID,
+		// connections accepted and closed, and write latency. Queue depths and drops
+		// are added up over the clients connected now. Safe from any thread, each
+		// counter is read without stopping the io threads, so the totals can be a
+		// message or so out from one another
+		metrics_snapshot<T> GetMetrics()
+		{
+			metrics_snapshot<T> snapshot;
+			for (auto& pMetrics : m_vMetrics)
 			{
-				m_threadContext.join();
+				pMetrics->AddTo(snapshot);
 			}
 
-			// Inform anybody who's listening
-			std::cout << "[SERVER] Stopped\n";
-
+			std::shared_ptr<const client_list> pClients = GetClients();
+			for (auto& client : *pClients)
+			{
+				if (client->IsConnected())
+				{
+					snapshot.nConnections++;
+					snapshot.nQueuedOutMessages += client->GetQueuedMessages();
+					snapshot.nQueuedOutBytes += client->GetQueuedBytes();
+				}
+				snapshot.nDropped += client->GetDroppedCount();
+				snapshot.nRejected += client->GetRejectedCount();
+				snapshot.nConflated += client->GetConflatedCount();
+			}
+			snapshot.nQueuedInMessages = m_qMessagesIn.count();
+			return snapshot;
 		}
 
-		// ASYNC - instruct asio to wait for connection
-		void WaitForClientConnection()
+		// ASYNC - instruct asio to wait for connection on one of the acceptors
+		void WaitForClientConnection(size_t nAcceptor = 0)
 		{
-			m_asioAcceptor.async_accept(
-				[this](std::error_code ec, asio::ip::tcp::socket socket)
+			// Pick the io thread the next client will live on. The socket is accepted
+			// straight into that thread's context. With several acceptors the kernel
+			// already spreads the clients, so keep each one on its acceptor's thread
+			asio::io_context& asioContext = m_vAcceptors.size() > 1 ? m_ioPool.GetContext(nAcceptor) : m_ioPool.GetNextContext();
+
+			m_vAcceptors[nAcceptor].async_accept(asioContext,
+				[this, &asioContext, nAcceptor](std::error_code ec, asio::ip::tcp::socket socket)
 				{
 					if (!ec)
 					{
-						std::cout << "[SERVER] New Connecton: " << socket.remote_endpoint() << "\n";
+						// The client may already have gone, so don't let this throw
+						asio::error_code ecEndpoint;
+						NET_LOG_INFO("[SERVER] New Connecton: ", socket.remote_endpoint(ecEndpoint));
 
 						// Create new connection to handle client
 						std::shared_ptr<connection<T>> newConn = std::make_shared<connection<T>>(connection<T>::owner::server, 
-							m_asioContext, std::move(socket), m_qMessagesIn);
+							asioContext, std::move(socket), m_qMessagesIn);
+						newConn->SetHeaderFilter(m_pfnHeaderFilter);
+						newConn->SetQueueLimits(m_queueLimits);
+						newConn->SetTimeouts(m_timeouts);
+						newConn->SetMetrics(&GetMetricsShard(asioContext));
+						newConn->SetTrafficMetrics(m_bConnectionTraffic);
+						if (m_nDispatchMode == dispatch_mode::inline_io)
+						{
+							newConn->SetMessageHandler(
+								[this](std::shared_ptr<connection<T>> client, message<T>& msg)
+								{
+									HandleMessage(std::move(client), msg);
+								});
+						}
 
 						// Give the server a chance to deny connection
 						if (OnClientConnect(newConn))
 						{
-							// Connection allowed, so add to container of new connections
-							m_deqConnections.push_back(std::move(newConn));
-
-							// Give connection new ID and the increment
-							m_deqConnections.back()->ConnectToClient(this, nIDCounter++);
-
-							std::cout << "[" << m_deqConnections.back()->GetID() << "] Connection Approved\n";
+							// Acceptors may be running on several threads at once. The old
+							// list of clients is let go of once the lock is
+							std::shared_ptr<const client_list> pOldClients;
+							std::scoped_lock lock(m_muxAccept);
+
+							// Connection allowed, so add to container of connections, which
+							// is also what gives it its ID
+							uint32_t nID = m_mapConnections.Insert(newConn);
+							if (nID != slot_map<std::shared_ptr<connection<T>>>::nInvalidID)
+							{
+								pOldClients = PublishClients();
+								newConn->ConnectToClient(this, nID);
+
+								// This is the acceptor's io thread, so its metrics are ours to count in
+								m_vMetrics[nAcceptor % m_vMetrics.size()]->nAccepted.Add();
+
+								NET_LOG_INFO("[", nID, "] Connection Approved");
+							}
+							else
+							{
+								NET_LOG_WARN("[-----] Connection Denied, too many clients");
+							}
 						}
 						else
 						{
-							std::cout << "[-----] Connection Denied\n";
+							NET_LOG_INFO("[-----] Connection Denied");
 						}
 					}
 					else
 					{
 						// Error occurred during acceptance
-						std::cout << "[SERVER] New Connection Error: " << ec.message() << "\n";
+						NET_LOG_WARN("[SERVER] New Connection Error: ", ec.message());
 					}
 
 					// Prime asio context with more work, waiting for another connection
-					WaitForClientConnection();
+					WaitForClientConnection(nAcceptor);
 				});
 		}
 
 		// Send a message to a specific client
-		void MessageClient(std::shared_ptr<connection<T>> client, const message<T>& msg)
+		send_status MessageClient(std::shared_ptr<connection<T>> client, const message<T>& msg)
+		{
+			return MessageClient(std::move(client), message<T>(msg));
+		}
+
+		// Send a message to a specific client, moving it rather than copying it
+		send_status MessageClient(std::shared_ptr<connection<T>> client, message<T>&& msg)
 		{
 			// Check client is legitimate
 			if (client && client->IsConnected())
 			{
 				// If yes, just send it
-				client->Send(msg);
+				return client->Send(std::move(msg));
 			}
 			else
 			{
 				// If we can't communicate with the client, might as well remove it
-				onClientDisconnect(client);
-				client.reset();
+				if (client && RemoveClient(client))
+				{
+					onClientDisconnect(client);
+				}
 
-				// Remove it from container
-				m_deqConnections.erase(
-					std::remove(m_deqConnections.begin(), m_deqConnections.end(), client), m_deqConnections.end());
+				return send_status::disconnected;
 			}
 		}
 
-		// Send message to all clients
+		// Send a message to the client with this ID. A client that has gone away, or
+		// an ID that was never handed out, counts as disconnected
+		send_status MessageClient(uint32_t nID, const message<T>& msg)
+		{
+			return MessageClient(nID, message<T>(msg));
+		}
+
+		send_status MessageClient(uint32_t nID, message<T>&& msg)
+		{
+			return MessageClient(FindClient(nID), std::move(msg));
+		}
+
+		// The client with this ID, or nullptr if there isn't one
+		std::shared_ptr<connection<T>> FindClient(uint32_t nID)
+		{
+			std::scoped_lock lock(m_muxAccept);
+			std::shared_ptr<connection<T>>* pClient = m_mapConnections.Find(nID);
+			return pClient ? *pClient : nullptr;
+		}
+
+		// Answer a client's request. The response carries the request's correlation ID,
+		// which is how the client matches it up (see client_interface::Request())
+		send_status Reply(std::shared_ptr<connection<T>> client, const message<T>& request, message<T> response)
+		{
+			response.header.correlation = request.header.correlation;
+			return MessageClient(std::move(client), std::move(response));
+		}
+
+		// Send message to all clients. The message is serialized once and every client
+		// sends the same bytes, rather than each getting its own copy
 		void MessageAllClients(const message<T>& msg, std::shared_ptr<connection<T>> pIgnoreClient = nullptr)
 		{
-			bool bInvalidClientExists = false;
+			MessageAllClients(shared_message<T>(msg), pIgnoreClient);
+		}
 
-			for (auto& client : m_deqConnections)
+		// Send an already serialized message to all clients
+		void MessageAllClients(const shared_message<T>& msg, std::shared_ptr<connection<T>> pIgnoreClient = nullptr)
+		{
+			ForEachClient([&](const std::shared_ptr<connection<T>>& client) { client->Send(msg); }, pIgnoreClient);
+		}
+
+		// Send a message to a specific client, replacing any message with the same key
+		// still waiting to go to them (see connection::SendConflated())
+		send_status MessageClientConflated(std::shared_ptr<connection<T>> client, message<T> msg, uint64_t nKey)
+		{
+			if (client && client->IsConnected())
+			{
+				return client->SendConflated(std::move(msg), nKey);
+			}
+			return send_status::disconnected;
+		}
+
+		// Send a message to all clients, replacing any message with the same key still
+		// waiting to go to each of them. Clients that are keeping up get every message,
+		// ones that have fallen behind only get the latest
+		void MessageAllClientsConflated(const message<T>& msg, uint64_t nKey, std::shared_ptr<connection<T>> pIgnoreClient = nullptr)
+		{
+			shared_message<T> shared(msg);
+			ForEachClient([&](const std::shared_ptr<connection<T>>& client) { client->SendConflated(shared, nKey); }, pIgnoreClient);
+		}
+
+	protected:
+		// The metrics counted into by connections on asioContext
+		metrics_shard<T>& GetMetricsShard(asio::io_context& asioContext)
+		{
+			for (size_t i = 0; i < m_ioPool.Size(); i++)
+			{
+				if (&m_ioPool.GetContext(i) == &asioContext)
+				{
+					return *m_vMetrics[i];
+				}
+			}
+			return *m_vMetrics[0];
+		}
+
+		// Every incoming message comes through here, from Update() or the io thread
+		void HandleMessage(std::shared_ptr<connection<T>> client, message<T>& msg)
+		{
+#ifdef NET_TRACE_STAGES
+			// Replies sent from in here carry on from this message's trace
+			trace_scope scope(msg.trace);
+#endif
+
+			if (m_nMetricsID && msg.header.id == *m_nMetricsID)
+			{
+				message<T> response;
+				response.header.id = *m_nMetricsID;
+				response << GetMetrics();
+				Reply(std::move(client), msg, std::move(response));
+				return;
+			}
+
+			OnMessage(std::move(client), msg);
+		}
+
+		// Call fnSend for every connected client but pIgnoreClient, removing any that
+		// have disconnected along the way
+		template<typename SendFn>
+		void ForEachClient(SendFn fnSend, const std::shared_ptr<connection<T>>& pIgnoreClient)
+		{
+			// No locks from here on, however many clients are coming and going
+			std::shared_ptr<const client_list> pClients = GetClients();
+
+			for (auto& client : *pClients)
 			{
 				// Check is client is connected
-				if (client && client->IsConnected())
+				if (client->IsConnected())
 				{
 					// Yup
 					if (client != pIgnoreClient)
 					{
-						client->Send(msg);
+						fnSend(client);
 					}
 				}
-				else
+				else if (RemoveClient(client))
 				{
-					// If we can't communicate with the client, might as well remove it
+					// If we can't communicate with the client, might as well remove it.
+					// That only changes the container, the list being gone through is
+					// left alone
 					onClientDisconnect(client);
-					client.reset();
-
-					// Set flag to later on remove dead clients
-					bInvalidClientExists = true;
 				}
 			}
+		}
+
+		// The connected clients, as of the last time anyone connected or disconnected.
+		// The list is never changed once made, connections coming and going make a new
+		// one instead (see PublishClients()), so it can be gone through without holding
+		// any lock, and getting it never waits
+		std::shared_ptr<const client_list> GetClients()
+		{
+			return std::atomic_load_explicit(&m_pClients, std::memory_order_acquire);
+		}
 
-			// Better to remove them now, so we don't invalidate container as we're going through it
-			if (bInvalidClientExists)
+		// Make a new list of clients from m_mapConnections and put it in place of the
+		// old one, which is returned. m_muxAccept must be held. The caller should let go
+		// of the old list after the lock, as it may hold the last reference to a
+		// connection that has just been removed
+		std::shared_ptr<const client_list> PublishClients()
+		{
+			auto pClients = std::make_shared<const client_list>(m_mapConnections.begin(), m_mapConnections.end());
+			return std::atomic_exchange_explicit(&m_pClients, std::move(pClients), std::memory_order_acq_rel);
+		}
+
+		// Take a client out of the container. Returns false if it already has been,
+		// so only one caller goes on to tell onClientDisconnect()
+		bool RemoveClient(const std::shared_ptr<connection<T>>& client)
+		{
+			// Declared before the lock, so destroyed after it's released
+			std::shared_ptr<const client_list> pOldClients;
+			std::scoped_lock lock(m_muxAccept);
+
+			// The ID may since have been given to someone else, so check it's the same client
+			std::shared_ptr<connection<T>>* pClient = m_mapConnections.Find(client->GetID());
+			if (pClient && *pClient == client)
 			{
-				m_deqConnections.erase(
-					std::remove(m_deqConnections.begin(), m_deqConnections.end(), nullptr), m_deqConnections.end());
+				m_mapConnections.Remove(client->GetID());
+
+				// Replace the list of clients straight away, so it doesn't keep the
+				// connection, its socket and its buffers alive
+				pOldClients = PublishClients();
+				return true;
 			}
+			return false;
 		}
 
+	public:
 		// Called by user to explicitly process some messages in queue
 		// Fore server side logic
 		void Update(size_t nMaxMessages = -1, bool bWait = false)
@@ -167,18 +459,34 @@ namespace net
 				m_qMessagesIn.wait();
 			}
 
-			// Process as many messages as you can up to nMaxMessages
-			size_t nMessageCount = 0;
-			while (nMessageCount < nMaxMessages && !m_qMessagesIn.empty())
+			// Clients whose connections have closed since last time
+			std::vector<std::shared_ptr<connection<T>>> vClosedClients;
 			{
-				// Grab the front message
-				auto msg = m_qMessagesIn.pop_front();
+				std::scoped_lock lock(m_muxClosed);
+				vClosedClients.swap(m_vClosedClients);
+			}
+			for (auto& client : vClosedClients)
+			{
+				onClientDisconnect(client);
+			}
 
-				// Pass to message handler
-				OnMessage(msg.remote, msg.msg);
+			// Process as many messages as you can up to nMaxMessages. Take them all out
+			// of the queue in one go, rather than locking it for every message
+			m_vMessagesUpdate.clear();
+			m_qMessagesIn.drain_into(m_vMessagesUpdate, nMaxMessages);
 
-				nMessageCount++;
+			for (auto& msg : m_vMessagesUpdate)
+			{
+#ifdef NET_TRACE_STAGES
+				msg.msg.trace.Stamp(trace_stage::dequeued);
+#endif
+
+				// Pass to message handler
+				HandleMessage(msg.remote, msg.msg);
 			}
+
+			// Don't hang on to the connections until the next update
+			m_vMessagesUpdate.clear();
 		}
 
 
@@ -210,22 +518,81 @@ namespace net
 
 		}
 
+		// Called by a connection when it closes, from its io thread. It's taken out of
+		// the container straight away. onClientDisconnect() is called from the next
+		// Update(), or right here when messages are handled on the io threads anyway
+		void OnClientClosed(std::shared_ptr<connection<T>> client)
+		{
+			if (RemoveClient(client))
+			{
+				if (m_nDispatchMode == dispatch_mode::inline_io)
+				{
+					onClientDisconnect(client);
+				}
+				else
+				{
+					std::scoped_lock lock(m_muxClosed);
+					m_vClosedClients.push_back(std::move(client));
+				}
+			}
+		}
+
+		// Called when a client's outgoing queue fills up, just before the policy is
+		// applied. Called from whichever thread was sending, once each time it fills
+		virtual void OnBackpressure(std::shared_ptr<connection<T>> client, backpressure_policy policy)
+		{
+
+		}
+
 	protected:
+		// keep this order, needs to be initialized like this
+		// Pool of contexts and their threads. Context 0 also runs the acceptor. Declared
+		// first so that it outlives every socket bound to one of its contexts
+		io_pool m_ioPool;
+
+		// Metrics, one lot per io thread, in the same order as the pool's contexts
+		std::vector<std::unique_ptr<metrics_shard<T>>> m_vMetrics;
+
 		// Thread safe queue for incoming message packets
-		tsqueue<owned_message<T>> m_qMessagesIn;
+		inbound_queue<owned_message<T>> m_qMessagesIn;
 
-		// Container of active validated connections
-		std::deque<std::shared_ptr<connection<T>>> m_deqConnections;
+		// Messages taken from the queue by Update(), kept to reuse its memory
+		std::vector<owned_message<T>> m_vMessagesUpdate;
 
-		// keep this order, needs to be initialized like this
-		asio::io_context m_asioContext;
-		std::thread m_threadContext;
+		// Container of active validated connections, which also hands out their IDs
+		slot_map<std::shared_ptr<connection<T>>> m_mapConnections;
+
+		// Need ports of connections. Only more than one when using SO_REUSEPORT
+		std::vector<asio::ip::tcp::acceptor> m_vAcceptors;
+
+		// Guards m_mapConnections, which acceptors add to from several threads
+		std::mutex m_muxAccept;
+
+		// What broadcasts go through, see GetClients(). Only ever read and replaced
+		// atomically, and only replaced while holding m_muxAccept
+		std::shared_ptr<const client_list> m_pClients = std::make_shared<const client_list>();
+
+		// Given to every new connection, see SetHeaderFilter()
+		header_filter<T> m_pfnHeaderFilter = nullptr;
+
+		// Given to every new connection, see SetQueueLimits()
+		queue_limits m_queueLimits;
+
+		// Given to every new connection, see SetTimeouts()
+		connection_timeouts<T> m_timeouts;
+
+		// Clients that have closed, waiting for Update() to tell onClientDisconnect()
+		std::mutex m_muxClosed;
+		std::vector<std::shared_ptr<connection<T>>> m_vClosedClients;
+
+		// Where OnMessage() is called from, see SetDispatchMode()
+		dispatch_mode m_nDispatchMode = dispatch_mode::queued;
 
-		// Need ports of connections
-		asio::ip::tcp::acceptor m_asioAcceptor;
+		// Messages with this ID are answered with GetMetrics(), see SetMetricsMessage()
+		std::optional<T> m_nMetricsID;
 
-		// Clients will be identitfied via an ID
-		uint32_t nIDCounter = 10000;
+		// Given to every new connection, see SetConnectionTrafficMetrics()
+		bool m_bConnectionTraffic = false;
 
 	};
 }
\ No newline at end of file
@@ -0,0 +1,267 @@
+#pragma once
+
+#include "net_common.h"
+
+#include <array>
+
+// Lots of timers sharing one asio timer
+
+namespace net
+{
+	// Timers for deadlines that are usually pushed back or cancelled before they
+	// pass, like idle timeouts, at 100ms resolution. Giving every connection its own
+	// asio::steady_timer would mean an entry in asio's timer queue per connection,
+	// reshuffled whenever one moves. Here, one asio timer ticks the wheel and each
+	// tick only looks at what is due, however many timers there are.
+	//
+	// Hierarchical, like the Linux kernel's old timer wheel. Level 0 has a slot for
+	// each of the next 64 ticks, level 1 a slot for each of the next 64 lots of 64
+	// ticks, and so on. Timers further off sit in a coarse slot, and are moved down a
+	// level when the wheel comes round to it. Scheduling and cancelling are O(1).
+	//
+	// There is one wheel per io_context, got with asio::use_service<timer_wheel>(),
+	// and it must only be used from that context's thread. It only ticks while it has
+	// timers, so it doesn't stop run() from returning
+	class timer_wheel : public asio::execution_context::service
+	{
+	public:
+		using clock = std::chrono::steady_clock;
+		static constexpr clock::duration tTick = std::chrono::milliseconds(100);
+
+	private:
+		// Timers are kept in circular lists, one per slot, each headed by a bare link
+		struct link
+		{
+			link* m_pPrev = nullptr;
+			link* m_pNext = nullptr;
+		};
+
+	public:
+		// Something to be done at a deadline. Usually a member of whatever it does it
+		// for, so scheduling it never allocates
+		class timer : private link
+		{
+		public:
+			explicit timer(std::function<void()> fnExpired)
+				: m_fnExpired(std::move(fnExpired))
+			{}
+
+			timer(const timer&) = delete;
+			timer& operator = (const timer&) = delete;
+
+			bool IsScheduled() const
+			{
+				return m_pNext != nullptr;
+			}
+
+		private:
+			friend class timer_wheel;
+
+			uint64_t m_nDeadline = 0;
+
+			// Held while scheduled, so whatever owns the timer can't go away under it
+			std::shared_ptr<void> m_pKeepAlive;
+			std::function<void()> m_fnExpired;
+		};
+
+	public:
+		inline static asio::execution_context::id id;
+
+		explicit timer_wheel(asio::io_context& asioContext)
+			: asio::execution_context::service(asioContext), m_timerTick(asioContext)
+		{
+			for (auto& vLevel : m_vSlots)
+			{
+				for (auto& slot : vLevel)
+				{
+					slot.m_pPrev = &slot;
+					slot.m_pNext = &slot;
+				}
+			}
+		}
+
+		// Call t's function once tDeadline has passed, at the next tick after it.
+		// Moves t if it is already scheduled. pKeepAlive is held on to until then
+		void Schedule(timer& t, clock::time_point tDeadline, std::shared_ptr<void> pKeepAlive)
+		{
+			if (t.IsScheduled())
+			{
+				Unlink(t);
+			}
+			else if (m_nScheduled++ == 0)
+			{
+				// Nothing has been ticking, so catch the wheel up to now in one go
+				m_nNow = ToTicks(clock::now());
+				StartTicking();
+			}
+
+			// Due at the first tick on or after the deadline, which mustn't be one that
+			// has already been and gone
+			uint64_t nDeadline = ToTicks(tDeadline + tTick - clock::duration(1));
+			t.m_nDeadline = std::max(nDeadline, m_nNow + 1);
+			t.m_pKeepAlive = std::move(pKeepAlive);
+			Link(t);
+		}
+
+		void Schedule(timer& t, clock::duration tAfter, std::shared_ptr<void> pKeepAlive)
+		{
+			Schedule(t, clock::now() + tAfter, std::move(pKeepAlive));
+		}
+
+		// Stop t from going off. Does nothing if it isn't scheduled
+		void Cancel(timer& t)
+		{
+			if (t.IsScheduled())
+			{
+				Unlink(t);
+				m_nScheduled--;
+
+				// Let go last, it may be all that's keeping t in existence
+				std::shared_ptr<void> pKeepAlive = std::move(t.m_pKeepAlive);
+			}
+		}
+
+		size_t size() const
+		{
+			return m_nScheduled;
+		}
+
+	private:
+		static constexpr size_t nLevelBits = 6;
+		static constexpr size_t nSlots = size_t(1) << nLevelBits;
+		static constexpr size_t nLevels = 4;
+
+		// Furthest ahead a timer can be, later ones go off this far ahead (19 days)
+		static constexpr uint64_t nMaxTicks = (uint64_t(1) << (nLevelBits * nLevels)) - 1;
+
+		static uint64_t ToTicks(clock::time_point t)
+		{
+			return uint64_t(t.time_since_epoch() / tTick);
+		}
+
+		// Put t in the slot for its deadline. The further off it is, the higher the level
+		void Link(timer& t)
+		{
+			uint64_t nDelta = t.m_nDeadline - m_nNow;
+			if (nDelta > nMaxTicks)
+			{
+				t.m_nDeadline = m_nNow + nMaxTicks;
+				nDelta = nMaxTicks;
+			}
+
+			size_t nLevel = 0;
+			while (nDelta >= (uint64_t(1) << (nLevelBits * (nLevel + 1))))
+			{
+				nLevel++;
+			}
+
+			link& slot = m_vSlots[nLevel][(t.m_nDeadline >> (nLevelBits * nLevel)) & (nSlots - 1)];
+			t.m_pPrev = slot.m_pPrev;
+			t.m_pNext = &slot;
+			slot.m_pPrev->m_pNext = &t;
+			slot.m_pPrev = &t;
+		}
+
+		static void Unlink(link& t)
+		{
+			t.m_pPrev->m_pNext = t.m_pNext;
+			t.m_pNext->m_pPrev = t.m_pPrev;
+			t.m_pPrev = nullptr;
+			t.m_pNext = nullptr;
+		}
+
+		void StartTicking()
+		{
+			m_timerTick.expires_at(clock::time_point(tTick * (m_nNow + 1)));
+			m_timerTick.async_wait(
+				[this](std::error_code ec)
+				{
+					if (!ec)
+					{
+						OnTick();
+					}
+				});
+		}
+
+		void OnTick()
+		{
+			// Usually one tick, more if the thread was busy
+			uint64_t nNow = ToTicks(clock::now());
+			while (m_nNow < nNow && m_nScheduled > 0)
+			{
+				Advance();
+			}
+
+			if (m_nScheduled > 0)
+			{
+				m_nNow = std::max(m_nNow, nNow);
+				StartTicking();
+			}
+		}
+
+		// Move the wheel on one tick and set off everything due then
+		void Advance()
+		{
+			m_nNow++;
+
+			// Coming round to the start of a slot in a level above, so spread that
+			// slot's timers out into the levels below
+			for (size_t nLevel = 1; nLevel < nLevels; nLevel++)
+			{
+				if ((m_nNow & ((uint64_t(1) << (nLevelBits * nLevel)) - 1)) != 0)
+				{
+					break;
+				}
+
+				link& slot = m_vSlots[nLevel][(m_nNow >> (nLevelBits * nLevel)) & (nSlots - 1)];
+				while (slot.m_pNext != &slot)
+				{
+					timer& t = static_cast<timer&>(*slot.m_pNext);
+					Unlink(t);
+					Link(t);
+				}
+			}
+
+			// Everything left in this slot is due now. Each is unlinked before it is
+			// called, so it can schedule itself again, or cancel others
+			link& slot = m_vSlots[0][m_nNow & (nSlots - 1)];
+			while (slot.m_pNext != &slot)
+			{
+				timer& t = static_cast<timer&>(*slot.m_pNext);
+				Unlink(t);
+				m_nScheduled--;
+
+				std::shared_ptr<void> pKeepAlive = std::move(t.m_pKeepAlive);
+				t.m_fnExpired();
+			}
+		}
+
+		// The context is going away, let go of everything
+		void shutdown() override
+		{
+			m_timerTick.cancel();
+			for (auto& vLevel : m_vSlots)
+			{
+				for (auto& slot : vLevel)
+				{
+					while (slot.m_pNext != &slot)
+					{
+						timer& t = static_cast<timer&>(*slot.m_pNext);
+						Unlink(t);
+						m_nScheduled--;
+						std::shared_ptr<void> pKeepAlive = std::move(t.m_pKeepAlive);
+					}
+				}
+			}
+		}
+
+	private:
+		std::array<std::array<link, nSlots>, nLevels> m_vSlots;
+
+		asio::steady_timer m_timerTick;
+
+		// The last tick that has been dealt with
+		uint64_t m_nNow = 0;
+		size_t m_nScheduled = 0;
+	};
+}
@@ -0,0 +1,381 @@
+#pragma once
+
+#include "net_common.h"
+#include "net_metrics.h"
+
+#include <array>
+#include <fstream>
+
+#if !defined(NET_TRACE_STEADY_CLOCK) && !defined(_MSC_VER) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+// Timestamps on each message as it goes through the framework, to see where the time goes.
+// Only included when building with NET_TRACE_STAGES, without it none of this exists
+
+namespace net
+{
+	// Where a message has got to. Incoming messages are stamped up to handler_done,
+	// a message sent while one is being handled carries the incoming one's stamps
+	// and goes on from there, its handler_done being when it was sent
+	enum class trace_stage : uint32_t
+	{
+		// Whole message read off the socket
+		read_complete,
+		// Put in the inbound queue. Skipped in dispatch_mode::inline_io. On a client,
+		// whose application takes messages from the queue itself, the last stage
+		// stamped unless the message answered a request
+		enqueued,
+		// Taken out of it by Update()
+		dequeued,
+		// OnMessage() or a request's callback returned, or for a reply, Send() was called
+		handler_done,
+		// Reached the connection's outgoing queue, on its io thread
+		write_queued,
+		// The write it went out in finished
+		write_complete,
+
+		count
+	};
+
+	// Cheapest clock there is. The CPU's timestamp counter on x86, which takes a few
+	// nanoseconds to read and on anything recent ticks at the same rate on every
+	// core, otherwise steady_clock in nanoseconds. Define NET_TRACE_STEADY_CLOCK to
+	// always use steady_clock
+	struct trace_clock
+	{
+		static uint64_t Now()
+		{
+#if !defined(NET_TRACE_STEADY_CLOCK) && (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__))
+			return __rdtsc();
+#else
+			return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+		}
+
+		// Where the clock and steady_clock were at the same moment, to work out the
+		// clock's rate from later. Just reads both, so is fine on any thread
+		struct calibration
+		{
+			uint64_t nTicks = Now();
+			std::chrono::steady_clock::time_point tTime = std::chrono::steady_clock::now();
+		};
+
+		// Worked out against steady_clock, since start. Waits until start is at least
+		// 10ms ago, to have enough to measure against, so keep it off hot paths
+		static double NanosecondsPerTick(const calibration& start)
+		{
+#if !defined(NET_TRACE_STEADY_CLOCK) && (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__))
+			std::chrono::steady_clock::time_point tNow = std::chrono::steady_clock::now();
+			if (tNow - start.tTime < std::chrono::milliseconds(10))
+			{
+				std::this_thread::sleep_until(start.tTime + std::chrono::milliseconds(10));
+				tNow = std::chrono::steady_clock::now();
+			}
+
+			uint64_t nTicks = Now() - start.nTicks;
+			return nTicks ? double(std::chrono::duration_cast<std::chrono::nanoseconds>(tNow - start.tTime).count()) / double(nTicks) : 1.0;
+#else
+			return 1.0;
+#endif
+		}
+	};
+
+	// A message's stamps, zero for stages it skipped or hasn't reached
+	struct message_trace
+	{
+		std::array<uint64_t, size_t(trace_stage::count)> vStamps{};
+
+		void Stamp(trace_stage nStage, uint64_t nTicks = trace_clock::Now())
+		{
+			vStamps[size_t(nStage)] = nTicks;
+		}
+
+		// The incoming message being handled on this thread, if any
+		static message_trace*& Current()
+		{
+			thread_local message_trace* pCurrent = nullptr;
+			return pCurrent;
+		}
+
+		// About to be sent. A reply to the message being handled picks up where it
+		// left off, anything else starts here
+		void OnSend()
+		{
+			message_trace* pCurrent = Current();
+			for (size_t i = 0; i < size_t(trace_stage::handler_done); i++)
+			{
+				vStamps[i] = pCurrent ? pCurrent->vStamps[i] : 0;
+			}
+			Stamp(trace_stage::handler_done);
+			vStamps[size_t(trace_stage::write_queued)] = 0;
+			vStamps[size_t(trace_stage::write_complete)] = 0;
+		}
+	};
+
+	// Everything recorded about stages, the time taken to reach each one from the
+	// last stage stamped before it, plus the whole journey
+	struct trace_snapshot
+	{
+		// In clock ticks, indexed by trace_stage. Index read_complete, which nothing
+		// comes before, holds the time from first stamp to write_complete instead
+		std::array<histogram_snapshot, size_t(trace_stage::count)> vStages;
+		double dNanosecondsPerTick = 1.0;
+
+		// Roughly how long dFraction of messages took to reach nStage, in nanoseconds
+		double Percentile(trace_stage nStage, double dFraction) const
+		{
+			return double(vStages[size_t(nStage)].Percentile(dFraction)) * dNanosecondsPerTick;
+		}
+
+		double Total(double dFraction) const
+		{
+			return Percentile(trace_stage::read_complete, dFraction);
+		}
+	};
+
+	// Collects the stamps of every traced message into histograms, and keeps a
+	// sample of whole traces to be written out with DumpSamples(). Fed by the
+	// framework as messages go through it
+	class stage_tracer
+	{
+	public:
+		// Never destroyed, like the logger, as connections may finish writing late
+		static stage_tracer& Get()
+		{
+			static stage_tracer* pTracer = new stage_tracer();
+			return *pTracer;
+		}
+
+		// Keep one in every nEvery finished outgoing traces, 0 for none. 1024 unless set
+		void SetSampleRate(uint32_t nEvery)
+		{
+			m_nSampleEvery.store(nEvery, std::memory_order_relaxed);
+		}
+
+		// How many traces to hold on to, the oldest going first. 65536 unless set
+		void SetMaxSamples(size_t nMaxSamples)
+		{
+			std::scoped_lock lock(m_muxSamples);
+			m_nMaxSamples = std::max<size_t>(nMaxSamples, 1);
+			m_vSamples.clear();
+			m_nNextSample = 0;
+		}
+
+		// An incoming message's handler has returned
+		void RecordInbound(const message_trace& trace)
+		{
+			stage_histograms& histograms = GetHistograms();
+			for (size_t i = size_t(trace_stage::enqueued); i <= size_t(trace_stage::handler_done); i++)
+			{
+				histograms.Record(trace, i);
+			}
+		}
+
+		// An outgoing message has been written
+		void RecordOutbound(const message_trace& trace)
+		{
+			stage_histograms& histograms = GetHistograms();
+			for (size_t i = size_t(trace_stage::write_queued); i <= size_t(trace_stage::write_complete); i++)
+			{
+				histograms.Record(trace, i);
+			}
+
+			// The whole journey goes in the first
+			size_t nFirst = FirstStamped(trace);
+			uint64_t nEnd = trace.vStamps[size_t(trace_stage::write_complete)];
+			if (nFirst < size_t(trace_stage::write_complete) && nEnd >= trace.vStamps[nFirst])
+			{
+				histograms.vStages[0].Add(nEnd - trace.vStamps[nFirst]);
+			}
+
+			uint32_t nEvery = m_nSampleEvery.load(std::memory_order_relaxed);
+			if (nEvery > 0 && ++histograms.nUntilSample >= nEvery)
+			{
+				histograms.nUntilSample = 0;
+				std::scoped_lock lock(m_muxSamples);
+				if (m_vSamples.size() < m_nMaxSamples)
+				{
+					m_vSamples.push_back(trace);
+				}
+				else
+				{
+					m_vSamples[m_nNextSample] = trace;
+				}
+				m_nNextSample = (m_nNextSample + 1) % m_nMaxSamples;
+			}
+		}
+
+		// Everything recorded so far, by every thread
+		trace_snapshot GetSnapshot()
+		{
+			trace_snapshot snapshot;
+			snapshot.dNanosecondsPerTick = trace_clock::NanosecondsPerTick(m_calibration);
+
+			std::scoped_lock lock(m_muxHistograms);
+			for (auto& pHistograms : m_vHistograms)
+			{
+				for (size_t i = 0; i < pHistograms->vStages.size(); i++)
+				{
+					pHistograms->vStages[i].AddTo(snapshot.vStages[i]);
+				}
+			}
+			return snapshot;
+		}
+
+		// Write the sampled traces to sPath as CSV, a line per message, oldest first.
+		// Each stage is in nanoseconds from the trace's first stamp, empty if skipped
+		bool DumpSamples(const std::string& sPath)
+		{
+			std::vector<message_trace> vSamples;
+			{
+				// Once full, the next to be overwritten is the oldest
+				std::scoped_lock lock(m_muxSamples);
+				size_t nOldest = m_vSamples.size() < m_nMaxSamples ? 0 : m_nNextSample;
+				vSamples.insert(vSamples.end(), m_vSamples.begin() + nOldest, m_vSamples.end());
+				vSamples.insert(vSamples.end(), m_vSamples.begin(), m_vSamples.begin() + nOldest);
+			}
+
+			std::ofstream file(sPath);
+			if (!file)
+			{
+				return false;
+			}
+
+			double dNanosecondsPerTick = trace_clock::NanosecondsPerTick(m_calibration);
+			file << "read_complete,enqueued,dequeued,handler_done,write_queued,write_complete\n";
+			for (const message_trace& trace : vSamples)
+			{
+				size_t nFirstStage = FirstStamped(trace);
+				uint64_t nFirst = nFirstStage < trace.vStamps.size() ? trace.vStamps[nFirstStage] : 0;
+				for (size_t i = 0; i < trace.vStamps.size(); i++)
+				{
+					if (i > 0)
+					{
+						file << ',';
+					}
+					if (trace.vStamps[i] != 0)
+					{
+						file << uint64_t(double(trace.vStamps[i] - nFirst) * dNanosecondsPerTick);
+					}
+				}
+				file << '\n';
+			}
+			return bool(file);
+		}
+
+	private:
+		// One thread's histograms, written by it alone and on cache lines of their own
+		struct alignas(64) stage_histograms
+		{
+			struct histogram
+			{
+				std::array<metric_counter, histogram_snapshot::nBuckets> vBuckets;
+
+				void Add(uint64_t nTicks)
+				{
+					vBuckets[histogram_snapshot::BucketOf(nTicks)].Add();
+				}
+
+				void AddTo(histogram_snapshot& snapshot) const
+				{
+					for (size_t i = 0; i < vBuckets.size(); i++)
+					{
+						snapshot.vBuckets[i] += vBuckets[i].Get();
+					}
+				}
+			};
+
+			std::array<histogram, size_t(trace_stage::count)> vStages;
+			uint32_t nUntilSample = 0;
+
+			// Time from the last stage stamped before nStage, if both were
+			void Record(const message_trace& trace, size_t nStage)
+			{
+				uint64_t nEnd = trace.vStamps[nStage];
+				if (nEnd == 0)
+				{
+					return;
+				}
+				for (size_t i = nStage; i-- > 0;)
+				{
+					if (trace.vStamps[i] != 0)
+					{
+						if (nEnd >= trace.vStamps[i])
+						{
+							vStages[nStage].Add(nEnd - trace.vStamps[i]);
+						}
+						return;
+					}
+				}
+			}
+		};
+
+		static size_t FirstStamped(const message_trace& trace)
+		{
+			size_t i = 0;
+			while (i < trace.vStamps.size() && trace.vStamps[i] == 0)
+			{
+				i++;
+			}
+			return i;
+		}
+
+		stage_tracer() = default;
+
+		// The calling thread's histograms. Kept after the thread finishes, what it
+		// recorded still counts
+		stage_histograms& GetHistograms()
+		{
+			thread_local stage_histograms* pHistograms = nullptr;
+			if (!pHistograms)
+			{
+				auto pNew = std::make_unique<stage_histograms>();
+				pHistograms = pNew.get();
+				std::scoped_lock lock(m_muxHistograms);
+				m_vHistograms.push_back(std::move(pNew));
+			}
+			return *pHistograms;
+		}
+
+	private:
+		// Made along with the tracer, on whichever thread first records something.
+		// Only a couple of clock reads, the rate is worked out when it's asked for
+		trace_clock::calibration m_calibration;
+
+		std::mutex m_muxHistograms;
+		std::vector<std::unique_ptr<stage_histograms>> m_vHistograms;
+
+		std::atomic<uint32_t> m_nSampleEvery = 1024;
+		std::mutex m_muxSamples;
+		std::vector<message_trace> m_vSamples;
+		size_t m_nMaxSamples = 65536;
+		size_t m_nNextSample = 0;
+	};
+
+	// Marks the incoming message being handled on this thread for as long as it is
+	// alive, so replies sent meanwhile carry on its trace. Records it once done
+	class trace_scope
+	{
+	public:
+		explicit trace_scope(message_trace& trace)
+			: m_trace(trace), m_pPrevious(message_trace::Current())
+		{
+			message_trace::Current() = &m_trace;
+		}
+
+		~trace_scope()
+		{
+			m_trace.Stamp(trace_stage::handler_done);
+			stage_tracer::Get().RecordInbound(m_trace);
+			message_trace::Current() = m_pPrevious;
+		}
+
+		trace_scope(const trace_scope&) = delete;
+		trace_scope& operator = (const trace_scope&) = delete;
+
+	private:
+		message_trace& m_trace;
+		message_trace* m_pPrevious;
+	};
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "net_common.h"
+#include "net_pool.h"
 
 // Thread safe queue
 
@@ -36,35 +37,69 @@ namespace net
 		// Adds an item to the back of Queue
 		void push_back(const T& item)
 		{
-			std::scoped_lock lock(muxQueue);
-			deqQueue.emplace_back(std::move(item));
+			{
+				std::scoped_lock lock(muxQueue);
+				deqQueue.emplace_back(item);
+				nItems = deqQueue.size();
+			}
+			notify();
+		}
 
-			std::unique_lock<std::mutex> ul(muxBlocking);
-			cvBlocking.notify_one();
+		// Adds an item to the back of Queue, moving it in
+		void push_back(T&& item)
+		{
+			{
+				std::scoped_lock lock(muxQueue);
+				deqQueue.emplace_back(std::move(item));
+				nItems = deqQueue.size();
+			}
+			notify();
+		}
+
+		// Constructs an item in place at the back of Queue
+		template<typename... Args>
+		void emplace_back(Args&&... args)
+		{
+			{
+				std::scoped_lock lock(muxQueue);
+				deqQueue.emplace_back(std::forward<Args>(args)...);
+				nItems = deqQueue.size();
+			}
+			notify();
 		}
 
 		// Adds an item to the front of Queue
 		void push_front(const T& item)
 		{
-			std::scoped_lock lock(muxQueue);
-			deqQueue.emplace_front(std::move(item));
+			{
+				std::scoped_lock lock(muxQueue);
+				deqQueue.emplace_front(item);
+				nItems = deqQueue.size();
+			}
+			notify();
+		}
 
-			std::unique_lock<std::mutex> ul(muxBlocking);
-			cvBlocking.notify_one();
+		// Adds an item to the front of Queue, moving it in
+		void push_front(T&& item)
+		{
+			{
+				std::scoped_lock lock(muxQueue);
+				deqQueue.emplace_front(std::move(item));
+				nItems = deqQueue.size();
+			}
+			notify();
 		}
 
 		// Returns true if Queue has no items
 		bool empty()
 		{
-			std::scoped_lock lock(muxQueue);
-			return deqQueue.empty();
+			return nItems == 0;
 		}
 
 		// Returns number of items in Queue
 		size_t count()
 		{
-			std::scoped_lock lock(muxQueue);
-			return deqQueue.size();
+			return nItems;
 		}
 
 		// Clear queue
@@ -72,6 +107,7 @@ namespace net
 		{
 			std::scoped_lock lock(muxQueue);
 			deqQueue.clear();
+			nItems = 0;
 		}
 
 		// Remove and return item from front of queue, as it should be
@@ -80,6 +116,7 @@ namespace net
 			std::scoped_lock lock(muxQueue);
 			auto t = std::move(deqQueue.front());
 			deqQueue.pop_front();
+			nItems = deqQueue.size();
 			return t;
 		}
 
@@ -87,25 +124,117 @@ namespace net
 		T pop_back()
 		{
 			std::scoped_lock lock(muxQueue);
-			auto t = std::move(deqQueue);
+			auto t = std::move(deqQueue.back());
 			deqQueue.pop_back();
+			nItems = deqQueue.size();
 			return t;
 		}
 
+		// Move up to nMaxItems from the front of the queue onto the back of a container,
+		// all under a single lock. Returns how many were moved
+		template<typename Container>
+		size_t drain_into(Container& container, size_t nMaxItems = -1)
+		{
+			std::scoped_lock lock(muxQueue);
+			size_t nCount = std::min(nMaxItems, deqQueue.size());
+			for (size_t i = 0; i < nCount; i++)
+			{
+				container.push_back(std::move(deqQueue[i]));
+			}
+			deqQueue.erase(deqQueue.begin(), deqQueue.begin() + nCount);
+			nItems = deqQueue.size();
+			return nCount;
+		}
+
+		// Block until the queue has something in it
 		void wait()
 		{
-			while (empty())
+			if (spin())
+			{
+				return;
+			}
+
+			std::unique_lock<std::mutex> ul(muxBlocking);
+			nSleepers++;
+			cvBlocking.wait(ul, [this]() { return !empty(); });
+			nSleepers--;
+		}
+
+		// Block until the queue has something in it, or the deadline passes. Returns
+		// false if it timed out with the queue still empty
+		template<typename Clock, typename Duration>
+		bool wait_until(const std::chrono::time_point<Clock, Duration>& tDeadline)
+		{
+			if (spin())
+			{
+				return true;
+			}
+
+			std::unique_lock<std::mutex> ul(muxBlocking);
+			nSleepers++;
+			bool bReady = cvBlocking.wait_until(ul, tDeadline, [this]() { return !empty(); });
+			nSleepers--;
+			return bReady;
+		}
+
+		// Block until the queue has something in it, or the time runs out. Returns
+		// false if it timed out with the queue still empty
+		template<typename Rep, typename Period>
+		bool wait_for(const std::chrono::duration<Rep, Period>& tTimeout)
+		{
+			return wait_until(std::chrono::steady_clock::now() + tTimeout);
+		}
+
+	protected:
+		// Wake a waiting thread, but only take the lock if somebody is actually asleep.
+		// nItems was changed before this is called and nSleepers is changed before the
+		// sleeper checks the queue, so one of the two is always seen by the other
+		void notify()
+		{
+			if (nSleepers > 0)
 			{
 				std::unique_lock<std::mutex> ul(muxBlocking);
-				cvBlocking.wait(ul);
+				cvBlocking.notify_one();
 			}
 		}
 
+		// Spin on the queue for a while before going to sleep, as going to sleep and being
+		// woken again costs a lot more than a short spin. How long we spin for adapts: it
+		// grows when spinning pays off and shrinks when it doesn't, so a busy queue is
+		// polled for its next item while an idle one parks straight away
+		bool spin()
+		{
+			int nBudget = nSpinBudget.load(std::memory_order_relaxed);
+			for (int i = 0; i < nBudget; i++)
+			{
+				if (!empty())
+				{
+					nSpinBudget.store(std::min(nBudget * 2 + 16, nMaxSpin), std::memory_order_relaxed);
+					return true;
+				}
+				cpu_relax();
+			}
+
+			nSpinBudget.store(nBudget / 2, std::memory_order_relaxed);
+			return !empty();
+		}
 
 	protected:
 		std::mutex muxQueue;
-		std::deque<T> deqQueue;
+		// Chunks come from the buffer pool, a deque frees and allocates them as items
+		// pass through
+		std::deque<T, pool_allocator<T>> deqQueue;
 		std::condition_variable cvBlocking;
 		std::mutex muxBlocking;
+
+		// Mirrors deqQueue.size() so it can be checked without the lock
+		std::atomic<size_t> nItems = 0;
+
+		// Threads currently asleep in one of the waits
+		std::atomic<int> nSleepers = 0;
+
+		// How many times the next wait checks the queue before going to sleep
+		static constexpr int nMaxSpin = 4096;
+		std::atomic<int> nSpinBudget = 256;
 	};
-}
\ No newline at end of file
+}
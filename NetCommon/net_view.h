@@ -0,0 +1,94 @@
+#pragma once
+
+#include "net_common.h"
+#include "net_message.h"
+
+#include <stdexcept>
+#include <type_traits>
+
+// Read-only views of received bytes, without copying them out
+
+namespace net
+{
+	// Looks at a body laid out as a packed array of Layout records, such as a batch
+	// of positions, and lets them be read where they are:
+	//
+	//	net::message_view<MsgTypes, position> positions(msg);
+	//	if (positions.valid())
+	//		for (const position& p : positions) ...
+	//
+	// A view doesn't own anything. It points into the message (or buffer) it was made
+	// from and is only good for as long as that is alive and unchanged, so it can't be
+	// made from a temporary message. Layout must be plain data with the same layout on
+	// both ends, and a body that isn't a whole number of records, or isn't aligned for
+	// Layout, is not valid()
+	template<typename T, typename Layout>
+	class message_view
+	{
+	public:
+		static_assert(std::is_trivially_copyable<Layout>::value, "Only plain data can be viewed in place");
+
+		message_view() = default;
+
+		message_view(const message<T>& msg)
+			: message_view(msg.body.data(), msg.body.size())
+		{}
+
+		// Would be left pointing at a message that no longer exists
+		message_view(message<T>&& msg) = delete;
+
+		// View any block of bytes, such as a message still in a receive buffer
+		message_view(const uint8_t* pData, size_t nBytes)
+			: m_pData(pData), m_nBytes(nBytes)
+		{
+			m_bValid = nBytes % sizeof(Layout) == 0 &&
+				(nBytes == 0 || reinterpret_cast<uintptr_t>(pData) % alignof(Layout) == 0);
+			m_nCount = m_bValid ? nBytes / sizeof(Layout) : 0;
+		}
+
+	public:
+		// True if the bytes hold a whole number of properly aligned records. An
+		// invalid view is empty
+		bool valid() const { return m_bValid; }
+
+		size_t size() const { return m_nCount; }
+		bool empty() const { return m_nCount == 0; }
+
+		const Layout* data() const { return reinterpret_cast<const Layout*>(m_pData); }
+		const Layout* begin() const { return data(); }
+		const Layout* end() const { return data() + m_nCount; }
+
+		// Unchecked, for loops that already know how many there are
+		const Layout& operator [] (size_t i) const
+		{
+			return data()[i];
+		}
+
+		// Checked, throws if i is past the end
+		const Layout& at(size_t i) const
+		{
+			if (i >= m_nCount)
+			{
+				throw std::out_of_range("message_view index out of range");
+			}
+			return data()[i];
+		}
+
+		// The bytes being viewed
+		const uint8_t* bytes() const { return m_pData; }
+		size_t byte_size() const { return m_nBytes; }
+
+	private:
+		const uint8_t* m_pData = nullptr;
+		size_t m_nBytes = 0;
+		size_t m_nCount = 0;
+		bool m_bValid = true;
+	};
+
+	// Tells views apart from other payload types
+	template<typename V>
+	struct is_message_view : std::false_type {};
+
+	template<typename T, typename Layout>
+	struct is_message_view<message_view<T, Layout>> : std::true_type {};
+}
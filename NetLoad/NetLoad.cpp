@@ -0,0 +1,508 @@
+#include <net.h>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <sstream>
+
+// Load generator for SimpleServer. Opens lots of connections and sends at a fixed
+// total rate, whatever the server does, printing a line of stats every second
+//
+// Usage: NetLoad [--host 127.0.0.1] [--port 60000] [--connections 100] [--rate 1000]
+//                [--seconds 10] [--payload 64] [--mix ping=100,all=0] [--threads N] [--json]
+//
+// --rate is messages per second over all connections. --mix weights the message
+// types sent: ping is bounced straight back by the server and timed, all makes the
+// server message every other client. Latency is timed from when each message was
+// meant to go, not from when it went, so a server that stalls shows up as a stall
+// rather than as the load quietly backing off (coordinated omission). errors adds
+// up sends that failed, connections that never got through the handshake and ones
+// that dropped during the run, each of which is also given on its own
+
+enum class CustomMsgTypes : uint32_t
+{
+	ServerAccept,
+	ServerDeny,
+	ServerPing,
+	MessageAll,
+	ServerMessage,
+	ClientJoined,
+};
+
+using clock_type = std::chrono::steady_clock;
+
+struct options
+{
+	std::string sHost = "127.0.0.1";
+	uint16_t nPort = 60000;
+	size_t nConnections = 100;
+	double dRate = 1000.0;
+	size_t nSeconds = 10;
+	size_t nPayload = 64;
+	size_t nThreads = std::max(1u, std::thread::hardware_concurrency());
+	uint32_t nPingWeight = 100;
+	uint32_t nAllWeight = 0;
+	bool bJson = false;
+};
+
+// Everything counted by one io thread, since it was last collected
+struct interval_stats
+{
+	size_t nSent = 0;
+	size_t nSendErrors = 0;
+	// Connections that never got through the handshake, and ones that closed
+	// while the run was going
+	size_t nConnectErrors = 0;
+	size_t nDisconnects = 0;
+	size_t nPongs = 0;
+	size_t nServerMessages = 0;
+	std::vector<uint32_t> vLatencyUs;
+
+	void Add(const interval_stats& other)
+	{
+		nSent += other.nSent;
+		nSendErrors += other.nSendErrors;
+		nConnectErrors += other.nConnectErrors;
+		nDisconnects += other.nDisconnects;
+		nPongs += other.nPongs;
+		nServerMessages += other.nServerMessages;
+		vLatencyUs.insert(vLatencyUs.end(), other.vLatencyUs.begin(), other.vLatencyUs.end());
+	}
+};
+
+// One connection. Replies are handled on the io thread, straight into its worker's stats
+class load_client : public net::client_interface<CustomMsgTypes>
+{
+public:
+	load_client(asio::io_context& context, interval_stats& stats)
+		: net::client_interface<CustomMsgTypes>(context), m_stats(stats)
+	{
+		SetDispatchMode(net::dispatch_mode::inline_io);
+
+		// Running behind counts as an error, rather than the connection being dropped
+		net::queue_limits limits;
+		limits.policy = net::backpressure_policy::drop_newest;
+		SetQueueLimits(limits);
+	}
+
+protected:
+	virtual void OnMessage(net::message<CustomMsgTypes>& msg)
+	{
+		if (msg.header.id == CustomMsgTypes::ServerPing)
+		{
+			// The time it was meant to be sent is on the end
+			int64_t nIntended = 0;
+			msg >> nIntended;
+			auto tIntended = clock_type::time_point(clock_type::duration(nIntended));
+			auto tLatency = std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - tIntended);
+
+			m_stats.nPongs++;
+			m_stats.vLatencyUs.push_back(uint32_t(std::max<int64_t>(tLatency.count(), 0)));
+		}
+		else
+		{
+			m_stats.nServerMessages++;
+		}
+	}
+
+private:
+	interval_stats& m_stats;
+};
+
+// The connections on one io thread, and the schedule they send to. Everything in
+// here runs on that thread, so nothing needs locking
+class load_worker
+{
+public:
+	load_worker(asio::io_context& context, const options& opts, double dRate)
+		: m_context(context), m_opts(opts), m_dRate(dRate), m_timerSend(context), m_rng(std::random_device{}())
+	{}
+
+	void AddClient()
+	{
+		m_vClients.push_back(std::make_unique<load_client>(m_context, m_stats));
+		m_vLost.push_back(false);
+		if (!m_vClients.back()->Connect(m_opts.sHost, m_opts.nPort))
+		{
+			// Couldn't even resolve the host
+			m_vLost.back() = true;
+			m_stats.nConnectErrors++;
+		}
+	}
+
+	size_t CountConnected() const
+	{
+		size_t nConnected = 0;
+		for (const auto& client : m_vClients)
+		{
+			nConnected += client->IsConnected() ? 1 : 0;
+		}
+		return nConnected;
+	}
+
+	// Begin sending, on the schedule starting at tStart
+	void Start(clock_type::time_point tStart)
+	{
+		asio::post(m_context,
+			[this, tStart]()
+			{
+				m_tStart = tStart;
+				m_nScheduled = 0;
+				m_bRunning = true;
+				SendDue();
+			});
+	}
+
+	void Stop()
+	{
+		asio::post(m_context,
+			[this]()
+			{
+				m_bRunning = false;
+				m_timerSend.cancel();
+			});
+	}
+
+	// Hand over what has been counted so far, from the io thread, and start again
+	std::future<interval_stats> TakeStats()
+	{
+		auto pPromise = std::make_shared<std::promise<interval_stats>>();
+		asio::post(m_context,
+			[this, pPromise]()
+			{
+				CountLost();
+				pPromise->set_value(std::exchange(m_stats, interval_stats{}));
+			});
+		return pPromise->get_future();
+	}
+
+	// Disconnect every client, from the io thread they run on, as clients sharing a
+	// context have to be. Done once the future is ready
+	std::future<void> Disconnect()
+	{
+		auto pPromise = std::make_shared<std::promise<void>>();
+		asio::post(m_context,
+			[this, pPromise]()
+			{
+				for (auto& client : m_vClients)
+				{
+					client->Disconnect();
+				}
+				pPromise->set_value();
+			});
+		return pPromise->get_future();
+	}
+
+private:
+	// Count the connections that have closed since last time, as failing to connect
+	// or as dropped, going by why they closed
+	void CountLost()
+	{
+		for (size_t i = 0; i < m_vClients.size(); i++)
+		{
+			if (m_vLost[i] || m_vClients[i]->IsConnected())
+			{
+				continue;
+			}
+			m_vLost[i] = true;
+
+			auto metrics = m_vClients[i]->GetMetrics();
+			if (metrics.vDisconnects[size_t(net::disconnect_reason::connect_failed)] > 0 || metrics.HandshakeFailures() > 0)
+			{
+				m_stats.nConnectErrors++;
+			}
+			else
+			{
+				m_stats.nDisconnects++;
+			}
+		}
+	}
+
+	// Send everything whose time has come, then sleep until the next one is due.
+	// Falling behind doesn't move the schedule, the messages just go late, and
+	// their latency shows it
+	void SendDue()
+	{
+		if (!m_bRunning || m_vClients.empty() || m_dRate <= 0.0)
+		{
+			return;
+		}
+
+		clock_type::time_point tNow = clock_type::now();
+		size_t nDue = size_t(std::chrono::duration<double>(tNow - m_tStart).count() * m_dRate);
+
+		while (m_nScheduled < nDue)
+		{
+			SendOne(IntendedTime(m_nScheduled));
+			m_nScheduled++;
+		}
+
+		m_timerSend.expires_at(IntendedTime(m_nScheduled));
+		m_timerSend.async_wait(
+			[this](std::error_code ec)
+			{
+				if (!ec)
+				{
+					SendDue();
+				}
+			});
+	}
+
+	clock_type::time_point IntendedTime(size_t nMessage) const
+	{
+		return m_tStart + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(double(nMessage) / m_dRate));
+	}
+
+	void SendOne(clock_type::time_point tIntended)
+	{
+		// Connections take turns
+		load_client& client = *m_vClients[m_nNextClient++ % m_vClients.size()];
+
+		net::message<CustomMsgTypes> msg;
+		uint32_t nPick = m_rng() % (m_opts.nPingWeight + m_opts.nAllWeight);
+		if (nPick < m_opts.nPingWeight)
+		{
+			msg.header.id = CustomMsgTypes::ServerPing;
+			msg.body.resize(m_opts.nPayload > sizeof(int64_t) ? m_opts.nPayload - sizeof(int64_t) : 0);
+			msg.header.size = uint32_t(msg.body.size());
+			msg << int64_t(tIntended.time_since_epoch().count());
+		}
+		else
+		{
+			msg.header.id = CustomMsgTypes::MessageAll;
+		}
+
+		m_stats.nSent++;
+		if (client.Send(std::move(msg)) != net::send_status::queued)
+		{
+			m_stats.nSendErrors++;
+		}
+	}
+
+private:
+	asio::io_context& m_context;
+	const options& m_opts;
+	double m_dRate;
+
+	std::vector<std::unique_ptr<load_client>> m_vClients;
+	size_t m_nNextClient = 0;
+
+	// Which clients have already been counted by CountLost()
+	std::vector<bool> m_vLost;
+	interval_stats m_stats;
+
+	// Message n is due at m_tStart + n / m_dRate
+	asio::steady_timer m_timerSend;
+	clock_type::time_point m_tStart;
+	size_t m_nScheduled = 0;
+	bool m_bRunning = false;
+
+	std::minstd_rand m_rng;
+};
+
+// One line of stats, for the dSeconds up to dElapsed. key=value text, or a JSON object with --json
+static void PrintStats(const options& opts, const char* sKind, double dElapsed, double dSeconds, size_t nConnected, interval_stats& stats)
+{
+	std::sort(stats.vLatencyUs.begin(), stats.vLatencyUs.end());
+	auto fnPercentile = [&](double dFraction) -> double
+	{
+		if (stats.vLatencyUs.empty())
+		{
+			return 0.0;
+		}
+		return stats.vLatencyUs[std::min(stats.vLatencyUs.size() - 1, size_t(dFraction * double(stats.vLatencyUs.size())))];
+	};
+
+	std::vector<std::pair<std::string, double>> vFields =
+	{
+		{ "t", dElapsed },
+		{ "connected", double(nConnected) },
+		{ "sent_per_sec", double(stats.nSent) / dSeconds },
+		{ "pongs_per_sec", double(stats.nPongs) / dSeconds },
+		{ "server_msgs_per_sec", double(stats.nServerMessages) / dSeconds },
+		{ "errors", double(stats.nSendErrors + stats.nConnectErrors + stats.nDisconnects) },
+		{ "send_errors", double(stats.nSendErrors) },
+		{ "connect_errors", double(stats.nConnectErrors) },
+		{ "disconnects", double(stats.nDisconnects) },
+		{ "p50_us", fnPercentile(0.50) },
+		{ "p99_us", fnPercentile(0.99) },
+		{ "p999_us", fnPercentile(0.999) },
+		{ "max_us", stats.vLatencyUs.empty() ? 0.0 : double(stats.vLatencyUs.back()) },
+	};
+
+	std::ostringstream os;
+	os.precision(12);
+	if (opts.bJson)
+	{
+		os << "{\"kind\":\"" << sKind << "\"";
+		for (const auto& f : vFields)
+		{
+			os << ",\"" << f.first << "\":" << f.second;
+		}
+		os << "}";
+	}
+	else
+	{
+		os << sKind;
+		for (const auto& f : vFields)
+		{
+			os << " " << f.first << "=" << f.second;
+		}
+	}
+	std::printf("%s\n", os.str().c_str());
+	std::fflush(stdout);
+}
+
+static bool ParseMix(const std::string& sMix, options& opts)
+{
+	opts.nPingWeight = 0;
+	opts.nAllWeight = 0;
+
+	std::istringstream is(sMix);
+	std::string sPart;
+	while (std::getline(is, sPart, ','))
+	{
+		size_t nEquals = sPart.find('=');
+		if (nEquals == std::string::npos)
+		{
+			return false;
+		}
+
+		std::string sType = sPart.substr(0, nEquals);
+		uint32_t nWeight = uint32_t(std::stoul(sPart.substr(nEquals + 1)));
+		if (sType == "ping")
+		{
+			opts.nPingWeight = nWeight;
+		}
+		else if (sType == "all")
+		{
+			opts.nAllWeight = nWeight;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return opts.nPingWeight + opts.nAllWeight > 0;
+}
+
+static bool ParseOptions(int argc, char** argv, options& opts)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string sArg = argv[i];
+		if (sArg == "--json")
+		{
+			opts.bJson = true;
+			continue;
+		}
+
+		// Everything else takes a value
+		if (i + 1 >= argc)
+		{
+			return false;
+		}
+		std::string sValue = argv[++i];
+
+		try
+		{
+			if (sArg == "--host") opts.sHost = sValue;
+			else if (sArg == "--port") opts.nPort = uint16_t(std::stoul(sValue));
+			else if (sArg == "--connections") opts.nConnections = std::stoull(sValue);
+			else if (sArg == "--rate") opts.dRate = std::stod(sValue);
+			else if (sArg == "--seconds") opts.nSeconds = std::stoull(sValue);
+			else if (sArg == "--payload") opts.nPayload = std::stoull(sValue);
+			else if (sArg == "--threads") opts.nThreads = std::max<size_t>(1, std::stoull(sValue));
+			else if (sArg == "--mix") { if (!ParseMix(sValue, opts)) return false; }
+			else return false;
+		}
+		catch (const std::exception&)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	options opts;
+	if (!ParseOptions(argc, argv, opts))
+	{
+		std::printf("Usage: NetLoad [--host 127.0.0.1] [--port 60000] [--connections 100] [--rate 1000]\n"
+			"               [--seconds 10] [--payload 64] [--mix ping=100,all=0] [--threads N] [--json]\n");
+		return 1;
+	}
+
+	// The framework logs every connection, keep it out of the stats
+	net::logger::Get().SetLevel(net::log_level::off);
+
+	// A worker per io thread, each with its share of the connections and the rate
+	size_t nThreads = std::min(opts.nThreads, std::max<size_t>(opts.nConnections, 1));
+	net::io_pool pool(nThreads);
+	std::vector<std::unique_ptr<load_worker>> vWorkers;
+	for (size_t i = 0; i < nThreads; i++)
+	{
+		size_t nClients = opts.nConnections / nThreads + (i < opts.nConnections % nThreads ? 1 : 0);
+		double dRate = opts.nConnections ? opts.dRate * double(nClients) / double(opts.nConnections) : 0.0;
+		vWorkers.push_back(std::make_unique<load_worker>(pool.GetContext(i), opts, dRate));
+		for (size_t j = 0; j < nClients; j++)
+		{
+			vWorkers.back()->AddClient();
+		}
+	}
+	pool.Start();
+
+	auto fnConnected = [&]()
+	{
+		size_t nConnected = 0;
+		for (auto& worker : vWorkers)
+		{
+			nConnected += worker->CountConnected();
+		}
+		return nConnected;
+	};
+
+	// Give the connections a moment to get through the handshake. Messages sent
+	// before then wait for it anyway
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+	clock_type::time_point tStart = clock_type::now();
+	for (auto& worker : vWorkers)
+	{
+		worker->Start(tStart);
+	}
+
+	interval_stats total;
+	for (size_t nSecond = 1; nSecond <= opts.nSeconds; nSecond++)
+	{
+		std::this_thread::sleep_until(tStart + std::chrono::seconds(nSecond));
+
+		interval_stats interval;
+		for (auto& worker : vWorkers)
+		{
+			interval.Add(worker->TakeStats().get());
+		}
+		total.Add(interval);
+		PrintStats(opts, "second", double(nSecond), 1.0, fnConnected(), interval);
+	}
+
+	for (auto& worker : vWorkers)
+	{
+		worker->Stop();
+	}
+
+	// Replies still on their way only make it into the total
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	for (auto& worker : vWorkers)
+	{
+		total.Add(worker->TakeStats().get());
+	}
+	PrintStats(opts, "total", double(opts.nSeconds), double(opts.nSeconds), fnConnected(), total);
+
+	for (auto& worker : vWorkers)
+	{
+		worker->Disconnect().wait();
+	}
+	pool.Stop();
+	return 0;
+}
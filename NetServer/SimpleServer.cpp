@@ -16,7 +16,7 @@ class CustomServer : public net::server_interface<CustomMsgTypes>
 public:
 	CustomServer(uint16_t nPort) : net::server_interface<CustomMsgTypes>(nPort)
 	{
-
+		SetHeaderFilter(router::Accepts);
 	}
 
 protected:
@@ -48,31 +48,33 @@ protected:
 	// Called when a message arrives
 	virtual void OnMessage(std::shared_ptr<net::connection<CustomMsgTypes>> client, net::message<CustomMsgTypes>& msg)
 	{
-		switch (msg.header.id)
-		{
-		case CustomMsgTypes::ServerPing:
-		{
-			std::cout << "[" << client->GetID() << "]: Server Ping\n";
+		router::Dispatch(*this, client, msg);
+	}
 
-			// Bounce the message birdman
-			client->Send(msg);
-		}
-		break;
+	void OnServerPing(std::shared_ptr<net::connection<CustomMsgTypes>> client, net::message<CustomMsgTypes>& msg)
+	{
+		std::cout << "[" << client->GetID() << "]: Server Ping\n";
 
-		case CustomMsgTypes::MessageAll:
-		{
-			std::cout << "[" << client->GetID() << "]: Message All\n";
+		// Bounce the message birdman. It's not needed anymore, so no need to copy it
+		client->Send(std::move(msg));
+	}
 
-			//Construct new message and send it to all clients
-			net::message<CustomMsgTypes> msg;
-			msg.header.id = CustomMsgTypes::ServerMessage;
-			msg << client->GetID();
-			MessageAllClients(msg, client);
-		}
-		break;
+	void OnMessageAll(std::shared_ptr<net::connection<CustomMsgTypes>> client, net::message<CustomMsgTypes>& msg)
+	{
+		std::cout << "[" << client->GetID() << "]: Message All\n";
 
-		}
+		//Construct new message and send it to all clients
+		net::message<CustomMsgTypes> msgAll;
+		msgAll.header.id = CustomMsgTypes::ServerMessage;
+		msgAll << client->GetID();
+		MessageAllClients(msgAll, client);
 	}
+
+	// Which handler each message goes to. Anything else clients send is dropped
+	// as soon as its header arrives
+	using router = net::message_router<CustomMsgTypes, CustomServer,
+		net::route<CustomMsgTypes::ServerPing, net::message<CustomMsgTypes>, &CustomServer::OnServerPing>,
+		net::route<CustomMsgTypes::MessageAll, net::message<CustomMsgTypes>, &CustomServer::OnMessageAll>>;
 };
 
 int main()
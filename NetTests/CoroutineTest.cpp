@@ -0,0 +1,121 @@
+#include "test.h"
+
+// The coroutine API: a message sent with AsyncSend() and echoed back is picked up
+// with AsyncReceive(), then a request made with AsyncRequest() gets its reply.
+// Needs C++20, and asio built with coroutine support
+
+#ifdef ASIO_HAS_CO_AWAIT
+
+namespace
+{
+	enum class TestMsgTypes : uint32_t
+	{
+		Echo,
+	};
+
+	// Sends every message straight back. Requests keep their correlation ID, so they
+	// come back as replies
+	class EchoServer : public net::server_interface<TestMsgTypes>
+	{
+	public:
+		EchoServer(uint16_t nPort)
+			: net::server_interface<TestMsgTypes>(nPort)
+		{
+			SetDispatchMode(net::dispatch_mode::inline_io);
+		}
+
+	protected:
+		virtual bool OnClientConnect(std::shared_ptr<net::connection<TestMsgTypes>> client)
+		{
+			return true;
+		}
+
+		virtual void OnMessage(std::shared_ptr<net::connection<TestMsgTypes>> client, net::message<TestMsgTypes>& msg)
+		{
+			client->Send(std::move(msg));
+		}
+	};
+
+	net::message<TestMsgTypes> MakeMessage(uint32_t nValue)
+	{
+		net::message<TestMsgTypes> msg;
+		msg.header.id = TestMsgTypes::Echo;
+		msg << nValue;
+		return msg;
+	}
+
+	uint32_t ValueOf(net::message<TestMsgTypes>& msg)
+	{
+		uint32_t nValue = 0;
+		msg >> nValue;
+		return nValue;
+	}
+
+	asio::awaitable<void> Session(net::client_interface<TestMsgTypes>& client, bool& bFinished)
+	{
+		using namespace std::chrono_literals;
+
+		net::send_status status = co_await client.AsyncSend(MakeMessage(1));
+		NET_CHECK(status == net::send_status::queued);
+
+		std::optional<net::message<TestMsgTypes>> echo = co_await client.AsyncReceive(5000ms);
+		NET_CHECK(echo.has_value());
+		if (echo)
+		{
+			NET_CHECK(ValueOf(*echo) == 1);
+		}
+
+		std::optional<net::message<TestMsgTypes>> reply = co_await client.AsyncRequest(MakeMessage(2), 5000ms);
+		NET_CHECK(reply.has_value());
+		if (reply)
+		{
+			NET_CHECK(ValueOf(*reply) == 2);
+		}
+
+		// Nothing else is coming, so this one runs out
+		std::optional<net::message<TestMsgTypes>> none = co_await client.AsyncReceive(50ms);
+		NET_CHECK(!none.has_value());
+
+		bFinished = true;
+		client.Disconnect();
+	}
+}
+
+int main()
+{
+	EchoServer server(60210);
+	NET_CHECK(server.Start());
+
+	// The client runs on this thread's context, which is where the coroutine runs too
+	asio::io_context context;
+	net::client_interface<TestMsgTypes> client(context);
+	NET_CHECK(client.Connect("127.0.0.1", 60210));
+
+	bool bFinished = false;
+	asio::co_spawn(context, Session(client, bFinished), asio::detached);
+
+	// Don't hang if something never completes
+	asio::steady_timer timerGiveUp(context, std::chrono::seconds(10));
+	timerGiveUp.async_wait([&](std::error_code ec) { if (!ec) context.stop(); });
+
+	while (!bFinished && !context.stopped())
+	{
+		context.run_one();
+	}
+	NET_CHECK(bFinished);
+
+	timerGiveUp.cancel();
+	context.stop();
+	server.Stop();
+	return test::Result();
+}
+
+#else
+
+int main()
+{
+	std::printf("asio has no coroutine support\n");
+	return 1;
+}
+
+#endif
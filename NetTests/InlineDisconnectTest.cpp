@@ -0,0 +1,85 @@
+#include "test.h"
+
+// A server handling messages inline disconnects a client partway through a batch
+// of messages that arrived in one read. The rest of the batch must not reach it
+
+namespace
+{
+	enum class TestMsgTypes : uint32_t
+	{
+		Count,
+	};
+
+	constexpr size_t nBatch = 10;
+	constexpr size_t nDisconnectAt = 3;
+
+	class DisconnectingServer : public net::server_interface<TestMsgTypes>
+	{
+	public:
+		DisconnectingServer(uint16_t nPort)
+			: net::server_interface<TestMsgTypes>(nPort)
+		{
+			SetDispatchMode(net::dispatch_mode::inline_io);
+		}
+
+		std::atomic<size_t> nMessages = 0;
+
+	protected:
+		virtual bool OnClientConnect(std::shared_ptr<net::connection<TestMsgTypes>> client)
+		{
+			return true;
+		}
+
+		virtual void OnMessage(std::shared_ptr<net::connection<TestMsgTypes>> client, net::message<TestMsgTypes>& msg)
+		{
+			if (++nMessages == nDisconnectAt)
+			{
+				client->Disconnect();
+			}
+		}
+	};
+
+	class CorkedClient : public net::client_interface<TestMsgTypes>
+	{
+	public:
+		// Hold writes back long enough for the whole batch to go out in one
+		void Cork()
+		{
+			m_connection->SetCorkWindow(std::chrono::milliseconds(200));
+		}
+	};
+}
+
+int main()
+{
+	DisconnectingServer server(60200);
+	NET_CHECK(server.Start());
+
+	CorkedClient client;
+	NET_CHECK(client.Connect("127.0.0.1", 60200));
+	client.Cork();
+
+	for (size_t i = 0; i < nBatch; i++)
+	{
+		net::message<TestMsgTypes> msg;
+		msg.header.id = TestMsgTypes::Count;
+		msg << uint64_t(i);
+		client.Send(std::move(msg));
+	}
+
+	// Time for the batch to be written, read and handled, and the disconnect to reach
+	// the client
+	auto tDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (client.IsConnected() && std::chrono::steady_clock::now() < tDeadline)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	NET_CHECK(!client.IsConnected());
+	NET_CHECK(server.nMessages == nDisconnectAt);
+
+	client.Disconnect();
+	server.Stop();
+	return test::Result();
+}
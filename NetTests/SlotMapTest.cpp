@@ -0,0 +1,105 @@
+#include "test.h"
+
+// slot_map must only ever find values that are really there, whatever ID it is
+// handed: one made up, one whose value has gone, or one removed twice
+
+namespace
+{
+	using map = net::slot_map<int>;
+
+	uint32_t MakeID(uint32_t nGeneration, uint32_t nSlot)
+	{
+		return (nGeneration << map::nSlotBits) | nSlot;
+	}
+
+	void ForgedIDs()
+	{
+		map m;
+		uint32_t nA = m.Insert(1);
+		uint32_t nB = m.Insert(2);
+		NET_CHECK(m.Remove(nA));
+
+		// Slot 0 is free and its generation has moved on to 2. An ID made up to
+		// match that must not find slot 0's old value, or anything else
+		uint32_t nForged = MakeID(2, nA & map::nSlotMask);
+		NET_CHECK(m.Find(nForged) == nullptr);
+		NET_CHECK(!m.Remove(nForged));
+
+		// Nor must removing it have freed the slot a second time
+		uint32_t nC = m.Insert(3);
+		uint32_t nD = m.Insert(4);
+		NET_CHECK(nC != nD);
+		NET_CHECK(m.size() == 3);
+		NET_CHECK(m.Find(nB) && *m.Find(nB) == 2);
+		NET_CHECK(m.Find(nC) && *m.Find(nC) == 3);
+		NET_CHECK(m.Find(nD) && *m.Find(nD) == 4);
+
+		// Slots that were never handed out, and the invalid ID
+		NET_CHECK(m.Find(MakeID(1, 1000)) == nullptr);
+		NET_CHECK(m.Find(map::nInvalidID) == nullptr);
+	}
+
+	void StaleIDs()
+	{
+		map m;
+		uint32_t nA = m.Insert(1);
+		NET_CHECK(m.Remove(nA));
+
+		// The slot is reused, the old ID must not reach the new value
+		uint32_t nB = m.Insert(2);
+		NET_CHECK((nA & map::nSlotMask) == (nB & map::nSlotMask));
+		NET_CHECK(nA != nB);
+		NET_CHECK(m.Find(nA) == nullptr);
+		NET_CHECK(!m.Remove(nA));
+		NET_CHECK(m.Find(nB) && *m.Find(nB) == 2);
+	}
+
+	void DoubleRemove()
+	{
+		map m;
+		uint32_t nA = m.Insert(1);
+		uint32_t nB = m.Insert(2);
+		NET_CHECK(m.Remove(nA));
+		NET_CHECK(!m.Remove(nA));
+
+		// Only one free slot, so only one insert may get it
+		uint32_t nC = m.Insert(3);
+		uint32_t nD = m.Insert(4);
+		NET_CHECK(nC != nD);
+		NET_CHECK((nC & map::nSlotMask) != (nD & map::nSlotMask));
+		NET_CHECK(m.size() == 3);
+		NET_CHECK(m.Find(nB) && *m.Find(nB) == 2);
+		NET_CHECK(m.Find(nC) && *m.Find(nC) == 3);
+		NET_CHECK(m.Find(nD) && *m.Find(nD) == 4);
+	}
+
+	// Values move about as others are removed, IDs must keep finding them
+	void RemoveMovesValues()
+	{
+		map m;
+		std::vector<uint32_t> vIDs;
+		for (int i = 0; i < 100; i++)
+		{
+			vIDs.push_back(m.Insert(i));
+		}
+		for (int i = 0; i < 100; i += 2)
+		{
+			NET_CHECK(m.Remove(vIDs[i]));
+		}
+		for (int i = 0; i < 100; i++)
+		{
+			const int* pValue = m.Find(vIDs[i]);
+			NET_CHECK(i % 2 == 0 ? pValue == nullptr : pValue && *pValue == i);
+		}
+		NET_CHECK(m.size() == 50);
+	}
+}
+
+int main()
+{
+	ForgedIDs();
+	StaleIDs();
+	DoubleRemove();
+	RemoveMovesValues();
+	return test::Result();
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <net.h>
+#include <cstdio>
+
+// Small helpers shared by all of the tests. Each test is a program of its own,
+// which fails by returning non-zero
+namespace test
+{
+	inline int nFailures = 0;
+
+	inline void Check(bool bPassed, const char* sWhat, const char* sFile, int nLine)
+	{
+		if (!bPassed)
+		{
+			std::printf("FAILED %s:%d: %s\n", sFile, nLine, sWhat);
+			nFailures++;
+		}
+	}
+
+	// What main() returns
+	inline int Result()
+	{
+		if (nFailures == 0)
+		{
+			std::printf("passed\n");
+		}
+		return nFailures == 0 ? 0 : 1;
+	}
+}
+
+#define NET_CHECK(x) test::Check((x), #x, __FILE__, __LINE__)